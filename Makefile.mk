@@ -82,7 +82,7 @@ DEPENDS = $(addprefix $(BUILD_DIR)/, $(CXXSRC:.cpp=.d) $(SRC:.c=.d))
 # Targets:
 
 # Phony targets for various output files
-typical: hex sizebefore sizeafter
+typical: hex sizebefore sizeram sizeafter
 elf: $(BUILD_DIR)/$(TARGET).elf
 hex: $(OUT_DIR)/$(TARGET).hex
 eep: $(BUILD_DIR)/$(TARGET).eep
@@ -126,6 +126,11 @@ dump:
 sizebefore: $(BUILD_DIR)/$(TARGET).elf
 	@echo "Size of $< (text=code, data=data, bss=uninitialized vars)"; $(SIZE) $(ELFSIZE_FLAGS)
 
+# Display static RAM usage
+sizeram: $(BUILD_DIR)/$(TARGET).elf
+	@echo "Static RAM of $< (the rest of the SRAM is left for the stack)"; \
+	$(SIZE) -A $< | awk '/^\.(data|bss|noinit) / { print; total += $$2 } END { print "total", total + 0 }'
+
 # Display hex size
 sizeafter: $(OUT_DIR)/$(TARGET).hex
 	@echo "Size of $< (data=size of code+data uploaded to the AVR)"; $(SIZE) $(HEXSIZE_FLAGS)
@@ -140,7 +145,7 @@ clean:
 
 
 # Targets that don't produce any file
-.PHONY:	typical elf hex eep lss sym program coff extcoff clean sizebefore sizeafter dump
+.PHONY:	typical elf hex eep lss sym program coff extcoff clean sizebefore sizeram sizeafter dump
 
 
 ############################################################################
@@ -17,11 +17,22 @@ void power_init(void)
     // Idle mode is the only mode that will keep the UART running
     SMCR = _BV(SE);     // enable sleep instruction, idle mode
 
-    // Disable TWI, all timers, USARTS except USART0, SPI and ADC.
+    // Disable TWI, all timers but 0 and 1 (trace timestamps), USARTS except
+    // USART0, SPI and ADC.
     // Note: SPI is need if debugging.
-    PRR0 = _BV(PRTWI) | _BV(PRTIM2) | _BV(PRTIM1) | _BV(PRSPI) | _BV(PRADC);
+    PRR0 = _BV(PRTWI) | _BV(PRTIM2) | _BV(PRSPI) | _BV(PRADC);
     PRR1 = _BV(PRTIM5) | _BV(PRTIM4) | _BV(PRTIM3) | _BV(PRUSART3) | _BV(PRUSART2) 
         | _BV(PRUSART1);
 }
 
+/**
+ * Undoes #power_init, leaving sleep and the modules as after a reset.
+ */
+void power_reset(void)
+{
+    SMCR = 0;
+    PRR0 = 0;
+    PRR1 = 0;
+}
+
 #endif
\ No newline at end of file
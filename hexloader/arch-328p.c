@@ -17,9 +17,18 @@ void power_init(void)
     // Idle mode is the only mode that will keep the UART running
     SMCR = _BV(SE);     // enable sleep instruction, idle mode
 
-    // Disable TWI, Timer 2, Timer 1, SPI and ADC.
+    // Disable TWI, Timer 2, SPI and ADC. Timer 1 timestamps the trace.
     // Note: SPI is need if debugging.
-    PRR = _BV(PRTWI) | _BV(PRTIM2) | _BV(PRTIM1) | _BV(PRSPI) | _BV(PRADC);
+    PRR = _BV(PRTWI) | _BV(PRTIM2) | _BV(PRSPI) | _BV(PRADC);
+}
+
+/**
+ * Undoes #power_init, leaving sleep and the modules as after a reset.
+ */
+void power_reset(void)
+{
+    SMCR = 0;
+    PRR = 0;
 }
 
 #endif
\ No newline at end of file
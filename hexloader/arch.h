@@ -1,11 +1,20 @@
 #pragma once
 
+#ifdef HOST
+
+// Simulated chip for host builds (see host/)
+#include "host/arch-host.h"
+
+#else
+
 #include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include <stdint.h>
 
 // Functions
 
 void power_init(void);
+void power_reset(void);
 
 // Architecture-dependent defines, macros and typedefs
 
@@ -14,8 +23,10 @@ void power_init(void);
 #define FLASH_SIZE                  0x8000          ///< atmega328p total flash
 #define NRWW_START                  0x7000          ///< can't flash beyond this while uart code runs
 #define PAGE_SIZE                   0x80            ///< atmega328p page size
+#define TRACE_LEN                   48              ///< trace events kept in SRAM
 
 #define INIT_LED() DDRB |= _BV(DDB5);
+#define RESET_LED() DDRB &= ~_BV(DDB5)      /**< Back to an input, as after reset */
 #define LED_ON() PORTB |= _BV(PORTB5)       /**< Turn on the LED */
 #define LED_OFF() PORTB &= ~_BV(PORTB5)     /**< Turn off the LED */
 
@@ -31,11 +42,13 @@ typedef uint16_t addr_t;
 #define FLASH_SIZE                  0x40000         ///< atmega2560 total flash
 #define NRWW_START                  0x3e000         ///< can't flash beyond this while uart code runs
 #define PAGE_SIZE                   0x100           ///< atmega2560 page size
+#define TRACE_LEN                   200             ///< trace events kept in SRAM
 
 #define USART_RX_vect               USART0_RX_vect
 #define USART_UDRE_vect             USART0_UDRE_vect
 
 #define INIT_LED() DDRB |= _BV(DDB7);
+#define RESET_LED() DDRB &= ~_BV(DDB7)      /**< Back to an input, as after reset */
 #define LED_ON() PORTB |= _BV(PORTB7)       /**< Turn on the LED */
 #define LED_OFF() PORTB &= ~_BV(PORTB7)     /**< Turn off the LED */
 
@@ -50,3 +63,4 @@ typedef uint32_t addr_t;
 #error "Unsupported chip (see config.h)"
 #endif
 
+#endif  // HOST
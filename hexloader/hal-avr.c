@@ -0,0 +1,670 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
+#include <avr/boot.h>
+#include <avr/wdt.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include "hal.h"
+
+// Constants
+
+#ifndef BAUD_RATE
+#define BAUD_RATE                   115200  //< Serial baudrate in bps (make BAUD_RATE=...)
+#endif
+
+#define APP_QUIET_MS                30      ///< rx silence required before jumping into the app (see #reboot)
+
+#define TICKS_PER_MS                250     ///< timer 0 counts per millisecond (see #timer_init)
+
+#define BOOTAPP_SIG_1               0xb0    // boot into app signature
+#define BOOTAPP_SIG_2               0xaa
+
+#define STACK_PAINT                 0xc5    ///< fill pattern of the unused stack
+
+#define TRACE_MAGIC                 0x7ace  ///< #trace_magic value when the trace ring is valid
+
+// Macros
+
+#define SERIAL_2X_UBRRVAL(baud) ((((F_CPU / 8) + (baud / 2)) / (baud)) - 1)
+
+/** Check if signature found in r2/r3, boot app is requested */
+#define BOOT_APP() (r2 == BOOTAPP_SIG_1 && r3 == BOOTAPP_SIG_2)
+
+/** Sleep while condition holds true.  */
+#define IDLE_WHILE(condition) \
+    do { \
+        cli(); \
+        if (condition) { \
+            sleeping = 1; \
+            sei(); \
+            sleep_cpu(); \
+            sleeping = 0; \
+        } else { \
+            sei(); \
+            break; \
+        } \
+    } while (1);
+
+
+// Variables
+
+/**
+ * Boot signature.
+ * Registers r2 and r3 are used to switch between bootloader and app at
+ * reset time.
+ */
+register uint8_t r2 asm("r2");
+register uint8_t r3 asm("r3");
+
+volatile uint8_t tx_buffer[TX_BUFFER_LEN];  ///< UART transmit buffer
+volatile uint8_t rx_buffer[RX_BUFFER_LEN];  ///< UART receive buffer
+volatile uint8_t rx_head, rx_tail, tx_head, tx_tail;
+volatile uint8_t uart_error;                ///< one of #ERROR_RX_DATA_OVERRUN, #ERROR_RX_FRAME_ERROR or #ERROR_RX_BUFFER_OVERFLOW
+volatile uint32_t clock;                    ///< number of milliseconds since boot */
+volatile uint8_t sleeping;                  ///< true while sleeping in #IDLE_WHILE
+volatile stats_t stats;                     ///< performance counters
+volatile uint8_t trace_epoch;               ///< timer 1 overflows
+volatile uint8_t trace_paused;              ///< don't trace while dumping the trace
+volatile uint8_t last_rx_level;             ///< last #TRACE_RX_LEVEL sample
+volatile int16_t breathing_led;
+
+extern uint8_t __heap_start;                ///< end of static RAM, the stack can grow down to here
+
+// The trace lives in .noinit, so that it survives the reboot after an error
+trace_t trace_ring[TRACE_LEN] __attribute__((section(".noinit")));  ///< trace events
+uint8_t trace_head __attribute__((section(".noinit")));             ///< next #trace_ring slot
+uint8_t trace_count __attribute__((section(".noinit")));            ///< events in #trace_ring
+uint16_t trace_magic __attribute__((section(".noinit")));           ///< #TRACE_MAGIC if the ring is valid
+
+
+///////////////////////////////////////////////////////////////////////
+// Tracing
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Record a trace event.
+ * Can be called from both ISRs and regular code.
+ * @param type one of the TRACE_* events
+ */
+void trace(uint8_t type)
+{
+    if (trace_paused)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        trace_t *e = &trace_ring[trace_head];
+
+        e->time = TCNT1;
+        e->epoch = trace_epoch;
+        // account for an overflow not serviced yet
+        if ((TIFR1 & _BV(TOV1)) && e->time < 0x8000)
+            e->epoch++;
+        e->type = type;
+        e->rx_level = (rx_head - rx_tail) % RX_BUFFER_LEN;
+        trace_head = (trace_head + 1) % TRACE_LEN;
+        if (trace_count < TRACE_LEN)
+            trace_count++;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// ISR routines
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * UART RX ISR.
+ * Called when the hardware UART receives a byte.
+ */
+ISR(USART_RX_vect)
+{
+    // UCSR0A must be read before UDR0
+    uint8_t status = UCSR0A;
+    uint8_t data = UDR0;    // this clears the interrupt flag
+    uint8_t new_head = (rx_head + 1) % RX_BUFFER_LEN;
+
+    if (status & _BV(DOR0)) {
+        uart_error |= ERROR_RX_DATA_OVERRUN;
+        stats.overruns++;
+    }
+    if (status & _BV(FE0)) {
+        uart_error |= ERROR_RX_FRAME_ERROR;
+        stats.frame_errors++;
+    }
+
+    // If head meets tail -> overflow and ignore the received byte
+    if (new_head == rx_tail) {
+        uart_error |= ERROR_RX_BUFFER_OVERFLOW;
+    }
+    else {
+        uint8_t level = (new_head - rx_tail) % RX_BUFFER_LEN;
+        if (level > stats.rx_max)
+            stats.rx_max = level;
+        rx_buffer[rx_head] = data;
+        rx_head = new_head;
+    }
+    // delay watchdog reboot while pending rx data
+    wdt_reset();
+}
+
+/**
+ * UART Data Register Empty ISR.
+ * Called when the UART is ready to accept a new byte for transmission.
+ */
+ISR(USART_UDRE_vect)
+{
+    if (tx_head == tx_tail) {
+        // Buffer is empty, disable UDRE int
+        UCSR0B &= ~_BV(UDRIE0);
+    }
+    else {
+        // Send byte
+        UDR0 = tx_buffer[tx_tail];
+        tx_tail = (tx_tail + 1) % TX_BUFFER_LEN;
+    }
+    // delay the reboot until no more pending tx
+    wdt_reset();
+}
+
+/**
+ * Timer 0 comparator A ISR.
+ * Called when timer 0 counts up to OCR0A. This is used to keep track
+ * of time and also for the breathing LED (software PWM). Also samples
+ * whether the CPU was asleep, to measure idle time.
+ */
+ISR(TIMER0_COMPA_vect)
+{
+    uint8_t c = ++clock;
+
+    if (sleeping)
+        stats.idle++;
+
+    LED_ON();
+    if ((c % 8) == 0) {
+        // breath in the lower half brightness range of the led (0 .. OCR0A / 2)
+        if (++breathing_led > OCR0A) breathing_led = 0;
+        if (breathing_led < OCR0A / 2)
+            OCR0B = breathing_led;
+        else
+            OCR0B = OCR0A - breathing_led;
+
+        // sample the rx buffer level when it changes
+        if (((rx_head - rx_tail) % RX_BUFFER_LEN) != last_rx_level) {
+            last_rx_level = (rx_head - rx_tail) % RX_BUFFER_LEN;
+            trace(TRACE_RX_LEVEL);
+        }
+    }
+}
+
+/**
+ * Timer 1 overflow ISR.
+ * Extends the trace timestamps beyond the 16 bit timer 1 count.
+ */
+ISR(TIMER1_OVF_vect)
+{
+    trace_epoch++;
+}
+
+/**
+ * Time 0 comparator B ISR.
+ * Called when timer 0 counts up to OCR0B. This is used for the breathing
+ * LED (software PWM). It is declared naked because it doesn't change
+ * registers or SREG.
+ */
+ISR(TIMER0_COMPB_vect, ISR_NAKED)
+{
+    LED_OFF();
+    reti();
+}
+
+/**
+ * SPM ready ISR.
+ * Called when the SPM instruction is done. It just disables SPMIE
+ * so that it doesn't get called infinitely.
+ */
+ISR(SPM_READY_vect)
+{
+    boot_spm_interrupt_disable();
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Timing functions
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Start the timer.
+ * Use the timer in CTC (clear timer on compare) mode to count up to OCR0A
+ * and generate interrupts on both OCR0A/OCR0B matches.
+ *
+ * With a prescaler = 64, OCR0A = 249 and CPU clock = 16 MHz, the period
+ * is 0.996ms (~ 1ms).
+ */
+void timer_init(void)
+{
+    TCCR0A = _BV(WGM01);                // CTC mode (count up to OCR0A)
+    OCR0A = 249;                        // 249 * 64 / 16M = 0.996 ms
+    TCCR0B = _BV(CS01) | _BV(CS00);     // clk/64 prescaler
+    TIMSK0 = _BV(OCIE0A) | _BV(OCIE0B); // Interrupt on both A, B match
+
+    // Timer 1 runs free at 4 us per tick for trace timestamps
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11) | _BV(CS10);     // clk/64 prescaler
+    TIMSK1 = _BV(TOIE1);                // Interrupt on overflow
+}
+
+/**
+ * Current time in ms.
+ * @return the number of milliseconds since reset
+ */
+uint32_t millis(void)
+{
+    uint32_t m;
+    cli();      // read atomically
+    m = clock;
+    sei();
+    return m;
+}
+
+/**
+ * Current time in timer 0 ticks (#US_PER_TICK microseconds).
+ * @return the number of ticks since reset
+ */
+uint32_t ticks(void)
+{
+    uint32_t m;
+    uint8_t t;
+    cli();      // read atomically
+    m = clock;
+    t = TCNT0;
+    // account for a compare match not serviced yet
+    if ((TIFR0 & _BV(OCF0A)) && t < OCR0A)
+        m++;
+    sei();
+    return m * TICKS_PER_MS + t;
+}
+
+/**
+ * Idle time.
+ * @return the number of milliseconds spent asleep since reset
+ */
+uint32_t idle_millis(void)
+{
+    uint32_t m;
+    cli();      // read atomically
+    m = stats.idle;
+    sei();
+    return m;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// UART functions
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Start the UART.
+ * Set the UART to 2x speed mode, BAUD_RATE bauds, 8N1 and enable rx
+ * interrupts.
+ */
+void uart_init(void)
+{
+    // Set baud rate
+    UBRR0 = SERIAL_2X_UBRRVAL(BAUD_RATE);
+
+    // double speed
+    UCSR0A = _BV(U2X0);
+
+    // 8,N,1
+    UCSR0C = (3 << UCSZ00);
+
+    // Enable receiver and transmitter, generate interrupts on RX, DRE
+    UCSR0B = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
+}
+
+/**
+ * Send a byte.
+ * If the tx queue is full, it will sleep (ie. block) until space becomes
+ * available.
+ * @param c the byte
+ */
+void uart_send_byte(uint8_t c)
+{
+    uint16_t new_head = (tx_head + 1) % TX_BUFFER_LEN;
+
+    if (tx_tail == new_head) {
+        stats.tx_stalls++;
+        trace(TRACE_TX_BLOCKED);
+    }
+    IDLE_WHILE(tx_tail == new_head);
+
+    tx_buffer[tx_head] = c;
+    tx_head = new_head;
+
+    // Enable UDRE int, this will trigger the UDRE ISR
+    UCSR0B |= _BV(UDRIE0);
+}
+
+/**
+  * Flush the tx buffer.
+  */
+void uart_flush(void)
+{
+    IDLE_WHILE(tx_tail != tx_head);
+}
+
+/**
+ * Receive a byte.
+ * @return an int16_t with the byte, will block until data is available.
+ */
+uint8_t uart_recv_byte(void)
+{
+    IDLE_WHILE(rx_tail == rx_head);
+
+    int8_t c = rx_buffer[rx_tail];
+    rx_tail = (rx_tail + 1) % RX_BUFFER_LEN;
+
+    return c;
+}
+
+/**
+ * Wait for incoming data.
+ * @param timeout milliseconds to wait at most
+ * @return true if data available
+ */
+uint8_t uart_wait(uint32_t timeout)
+{
+    uint32_t t0 = millis();
+
+    // the timer interrupt wakes us up every millisecond
+    IDLE_WHILE(rx_tail == rx_head && millis() - t0 < timeout);
+    return rx_tail != rx_head;
+}
+
+/**
+ * Check if there is incoming data over the UART.
+ * @return true if data available
+ */
+int8_t uart_available(void)
+{
+    return (rx_tail != rx_head);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Flash programming
+///////////////////////////////////////////////////////////////////////
+
+// All operations involving SPM are timed sequences and must be protected
+// from interrupts with cli()/sei(), ie. boot_page_*.
+
+/**
+ * Erase a flash page.
+ * Sleeps until the erase is done, while the UART keeps running.
+ * @param address the page address
+ */
+void flash_erase_page(addr_t address)
+{
+    cli();
+    boot_page_erase(address);       // erase page
+    boot_spm_interrupt_enable();    // let SPM-ready interrupt wake us up
+    sei();
+
+    IDLE_WHILE(boot_spm_busy());    // sleep until SPM is done
+}
+
+/**
+ * Write an erased flash page.
+ * Sleeps until the write is done, while the UART keeps running.
+ * @param address the page address
+ * @param data #PAGE_SIZE bytes to write
+ */
+void flash_write_page(addr_t address, uint8_t const *data)
+{
+    uint16_t i;
+
+    for (i = 0; i < PAGE_SIZE; i += 2) {
+        // make little endian words by swapping every two bytes
+        uint16_t word = data[i] | (data[i+1] << 8);
+        cli();
+        boot_page_fill(address + i, word);
+        // no need to IDLE_WAIT(boot_spm_busy()) here
+        sei();
+    }
+
+    cli();
+    boot_page_write(address);       // write page
+    boot_spm_interrupt_enable();    // let SPM-ready int wake us up
+    sei();
+
+    IDLE_WHILE(boot_spm_busy());    // sleep until SPM done
+}
+
+/**
+ * Re-enable the RWW area.
+ * Must be called after programming, before reading the flash back.
+ */
+void flash_rww_enable(void)
+{
+    cli();
+    boot_rww_enable();
+    boot_spm_interrupt_enable();
+    sei();
+    IDLE_WHILE(boot_spm_busy());
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// EEPROM
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Read from the EEPROM.
+ * @param dst destination buffer
+ * @param address EEPROM address
+ * @param n number of bytes
+ */
+void eeprom_read(void *dst, uint16_t address, uint8_t n)
+{
+    eeprom_read_block(dst, (void const *)address, n);
+}
+
+/**
+ * Write to the EEPROM.
+ * Only changed bytes are written, so this is cheap when nothing changed.
+ * @param src source buffer
+ * @param address EEPROM address
+ * @param n number of bytes
+ */
+void eeprom_write(void const *src, uint16_t address, uint8_t n)
+{
+    eeprom_update_block(src, (void *)address, n);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Stack measurement
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Stack headroom.
+ * Counts the bytes painted at startup which the stack never reached.
+ * @return the number of untouched stack bytes
+ */
+uint16_t stack_free(void)
+{
+    uint8_t *p = &__heap_start;
+    while (p < (uint8_t *)SP && *p == STACK_PAINT)
+        p++;
+    return p - &__heap_start;
+}
+
+/**
+ * Stack size.
+ * @return the number of SRAM bytes left for the stack
+ */
+uint16_t stack_size(void)
+{
+    return RAMEND + 1 - (uint16_t)&__heap_start;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Reboot functions
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Put the peripherals used by the bootloader back as they are after a
+ * reset, so that the app can't tell it was jumped into.
+ */
+void peripherals_reset(void)
+{
+    // UART
+    UCSR0B = 0;
+    UCSR0A = 0;
+    UCSR0C = (3 << UCSZ00);
+    UBRR0 = 0;
+
+    // timers, clearing any pending interrupt flags
+    TIMSK0 = 0;
+    TCCR0A = TCCR0B = 0;
+    TCNT0 = OCR0A = OCR0B = 0;
+    TIFR0 = _BV(OCF0B) | _BV(OCF0A) | _BV(TOV0);
+    TIMSK1 = 0;
+    TCCR1A = TCCR1B = 0;
+    TCNT1 = 0;
+    TIFR1 = _BV(ICF1) | _BV(OCF1B) | _BV(OCF1A) | _BV(TOV1);
+
+    boot_spm_interrupt_disable();
+    LED_OFF();
+    RESET_LED();
+    power_reset();
+
+    // ISR vector table back to the app
+    MCUCR = _BV(IVCE);
+    MCUCR = 0;
+}
+
+/** Force a reboot.
+ * To come back to the bootloader, reboots the AVR by setting the watchdog
+ * timer. Interrupts are allowed, so that pending rx or tx data gets
+ * flushed.
+ *
+ * To boot the app, waits for the tx buffer to drain and for the rx line
+ * to go quiet for #APP_QUIET_MS, dropping whatever arrives in the
+ * meantime, then resets the peripherals and jumps straight into the app.
+ * The watchdog is armed anyway, as a fallback.
+ *
+ * Registers r2/r3 = 0xb0aa are used to signal app run, r2 = r3 = 0
+ * signal bootloader run.
+ * @param to_app true to boot the app, false to come back to the bootloader
+ */
+void __attribute__((noreturn)) reboot(uint8_t to_app)
+{
+    if (to_app) {
+        r2 = BOOTAPP_SIG_1;
+        r3 = BOOTAPP_SIG_2;
+    }
+    else {
+        r2 = r3 = 0;
+    }
+
+    // There is a 70-90 ms bluetooth 'silence' after the 1 KB or so is
+    // received. In order to flush a possibly long paste, set the watchdog
+    // timer to reboot after 120 ms of inactivity.
+    wdt_enable(WDTO_120MS);
+
+    if (to_app) {
+        uint32_t quiet;
+
+        uart_flush();
+        quiet = millis();
+        while (millis() - quiet < APP_QUIET_MS) {
+            if (uart_available()) {
+                rx_tail = rx_head;
+                quiet = millis();
+            }
+            sleep_cpu();
+        }
+
+        cli();
+        wdt_disable();
+        peripherals_reset();
+        r2 = r3 = 0;
+        asm("jmp 0");               // go to app
+        __builtin_unreachable();    // suppress 'noreturn does return' warning
+    }
+
+    for (;;) {
+        sleep_cpu();
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Startup
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Set up the hardware for the bootloader.
+ */
+void hal_init(void)
+{
+    uint8_t *p;
+
+    // Paint the free stack to measure its high-water mark (see
+    // #stack_free). Interrupts are still off, so nothing else is using it.
+    for (p = &__heap_start; p < (uint8_t *)SP; p++)
+        *p = STACK_PAINT;
+
+    // Move ISR vector table to the bootloader
+    MCUCR = _BV(IVCE);
+    MCUCR = _BV(IVSEL);
+
+    // init led pin direction
+    INIT_LED();
+
+    // keep the trace of the last session unless it is garbage (power on)
+    if (trace_magic != TRACE_MAGIC || trace_head >= TRACE_LEN || trace_count > TRACE_LEN) {
+        trace_head = trace_count = 0;
+        trace_magic = TRACE_MAGIC;
+    }
+
+    // init sleep mode, uart and timer
+    power_init();
+    uart_init();
+    timer_init();
+    sei();
+}
+
+/**
+ * Entry point.
+ * Decides whether to run the bootloader or the user app.
+ */
+void __attribute__((noreturn)) main(void) {
+    // Disable the watchdog if set
+    uint8_t mcusr = MCUSR;
+    if (mcusr & _BV(WDRF)) {
+        MCUSR = mcusr & ~_BV(WDRF);
+        wdt_disable();
+    }
+
+    // Boot into app if
+    // (just powered on (no external or watchdog reset),
+    // OR bootloader 0xb0aa signature found (boot into app))
+    // AND (program memory is not empty)
+    if ((!(mcusr & (_BV(EXTRF) | _BV(WDRF))) || BOOT_APP())
+            && pgm_read_word_near(0) != 0xffff) {
+        r2 = r3 = 0;
+        asm("jmp 0");               // go to app
+        __builtin_unreachable();    // suppress 'noreturn does return' warning
+    }
+    else {
+        r2 = BOOTAPP_SIG_1;
+        r3 = BOOTAPP_SIG_2;
+        bootloader();
+    }
+}
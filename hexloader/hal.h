@@ -0,0 +1,122 @@
+#pragma once
+
+/**
+ * Hardware abstraction layer.
+ *
+ * Everything the bootloader core (hexloader.c) needs from the hardware:
+ * UART, timers, flash programming, EEPROM, tracing and rebooting. It is
+ * implemented for the AVR in hal-avr.c and, for running the core on a
+ * Linux box with a simulated flash and an in-memory serial stream, in
+ * host/hal-host.c.
+ */
+
+#include <stdint.h>
+#include "arch.h"
+
+// Constants
+
+#define ERROR_RX_DATA_OVERRUN       1       ///< UART data overrun
+#define ERROR_RX_FRAME_ERROR        2       ///< UART frame error
+#define ERROR_RX_BUFFER_OVERFLOW    4       ///< UART rx buffer overflow
+
+#define RX_BUFFER_LEN               256     //< receive buffer length
+#define TX_BUFFER_LEN               256     //< transmit buffer length
+
+#define US_PER_TICK                 4       ///< microseconds per #ticks count
+
+#define TRACE_BOOT                  'B'     ///< trace event: bootloader started
+#define TRACE_LINE                  'L'     ///< trace event: hex line decoded
+#define TRACE_ERASE_START           'e'     ///< trace event: page erase started
+#define TRACE_ERASE_END             'E'     ///< trace event: page erase done
+#define TRACE_WRITE_START           'w'     ///< trace event: page write started
+#define TRACE_WRITE_END             'W'     ///< trace event: page write done
+#define TRACE_RX_LEVEL              'F'     ///< trace event: rx buffer level sample
+#define TRACE_TX_BLOCKED            'T'     ///< trace event: tx buffer full
+
+
+// Types
+
+/**
+ * Trace event.
+ * Timestamps are 4 us ticks, extended with the number of 16 bit
+ * timer overflows.
+ */
+typedef struct {
+    uint8_t epoch;              ///< timer overflows, upper bits of the timestamp
+    uint16_t time;              ///< timer count
+    uint8_t type;               ///< one of the TRACE_* events
+    uint8_t rx_level;           ///< rx buffer level at the time of the event
+} trace_t;
+
+/** Min/max/total durations of an SPM operation, in #ticks. */
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t total;
+} spm_timing_t;
+
+/**
+ * Performance counters.
+ * Shown by the 's' command, they tell how close to its limits the
+ * bootloader runs on a given link.
+ */
+typedef struct {
+    uint8_t rx_max;             ///< rx buffer high-water mark
+    uint16_t frame_errors;      ///< UART frame errors
+    uint16_t overruns;          ///< UART data overruns
+    uint16_t tx_stalls;         ///< times #uart_send_byte waited for room in the tx buffer
+    uint16_t lines;             ///< hex lines processed
+    uint16_t pages;             ///< pages flashed
+    uint32_t idle;              ///< milliseconds asleep waiting for the hardware
+    spm_timing_t erase;         ///< page erase durations
+    spm_timing_t write;         ///< page write durations
+} stats_t;
+
+
+// Variables
+
+extern volatile uint8_t uart_error;         ///< one of #ERROR_RX_DATA_OVERRUN, #ERROR_RX_FRAME_ERROR or #ERROR_RX_BUFFER_OVERFLOW
+extern volatile stats_t stats;              ///< performance counters, updated by both the HAL and the core
+
+extern trace_t trace_ring[TRACE_LEN];       ///< trace events
+extern uint8_t trace_head;                  ///< next #trace_ring slot
+extern uint8_t trace_count;                 ///< events in #trace_ring
+extern volatile uint8_t trace_paused;       ///< don't trace while dumping the trace
+
+
+// Functions
+
+// Core entry point, called by the HAL once the hardware is ready
+void __attribute__((noreturn)) bootloader(void);
+
+// Setup
+void hal_init(void);
+
+// Timing
+uint32_t millis(void);
+uint32_t ticks(void);
+uint32_t idle_millis(void);
+
+// UART
+void uart_send_byte(uint8_t c);
+void uart_flush(void);
+uint8_t uart_recv_byte(void);
+uint8_t uart_wait(uint32_t timeout);
+int8_t uart_available(void);
+
+// Flash programming (see R() in arch.h for reading)
+void flash_erase_page(addr_t address);
+void flash_write_page(addr_t address, uint8_t const *data);
+void flash_rww_enable(void);
+
+// EEPROM
+void eeprom_read(void *dst, uint16_t address, uint8_t n);
+void eeprom_write(void const *src, uint16_t address, uint8_t n);
+
+// Tracing and stack measurement
+void trace(uint8_t type);
+uint16_t stack_free(void);
+uint16_t stack_size(void);
+
+// Reboot
+void __attribute__((noreturn)) reboot(uint8_t to_app);
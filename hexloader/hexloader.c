@@ -1,13 +1,4 @@
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
-#include <avr/sleep.h>
-#include <avr/power.h>
-#include <avr/pgmspace.h>
-#include <avr/boot.h>
-#include <avr/wdt.h>
-#include <util/delay.h>
-#include "arch.h"
+#include "hal.h"
 
 // Constants
 
@@ -17,19 +8,12 @@
 #endif
 #define DEBUG
 
-#define BAUD_RATE                   115200  //< Serial baudrate in bps
-#define RX_BUFFER_LEN               256     //< receive buffer length
-#define TX_BUFFER_LEN               256     //< transmit buffer length
 #define LF                          10      //< \n ascii
 #define CR                          13      //< \r ascii
 #define ESC                         27      //< ESC ascii
 #define BS                          8       //< backspace ascii
 #define DEL                         127     //< delete ascii (some terminals send this instead of BS)
 
-#define ERROR_RX_DATA_OVERRUN       1       ///< UART data overrun
-#define ERROR_RX_FRAME_ERROR        2       ///< UART frame error
-#define ERROR_RX_BUFFER_OVERFLOW    4       ///< UART #rx_buffer overflow
-
 #define MODE_FLASH                  0       ///< #flash_hex_line mode (flash)
 #define MODE_VERIFY                 1       ///< #flash_hex_line mode (verify)
 
@@ -40,148 +24,36 @@
 
 #define MAX_LINE_LEN                64      ///< 16 hex bytes/line as generated by objcopy
 
-#define BOOTAPP_SIG_1               0xb0    // boot into app signature
-#define BOOTAPP_SIG_2               0xaa
-
-char const CRLF[] = "\r\n";
+#define AUTOBOOT_MS                 30000   ///< boot the app after this long without input, 0 to wait forever
 
-// Macros
+#define JOURNAL                     (E2END + 1 - sizeof(journal_t))  ///< resume journal at the end of the EEPROM
 
-#define SERIAL_2X_UBRRVAL(baud) ((((F_CPU / 8) + (baud / 2)) / (baud)) - 1)
+char const CRLF[] = "\r\n";
 
-/** Check if signature found in r2/r3, boot app is requested */
-#define BOOT_APP() (r2 == BOOTAPP_SIG_1 && r3 == BOOTAPP_SIG_2)
+// Types
 
-/** Sleep while condition holds true.  */
-#define IDLE_WHILE(condition) \
-    do { \
-        cli(); \
-        if (condition) { \
-            sei(); \
-            sleep_cpu(); \
-        } else { \
-            sei(); \
-            break; \
-        } \
-    } while (1);
+/**
+ * Upload resume journal.
+ * Kept in EEPROM so that a failed upload can be resumed in the next
+ * bootloader session.
+ */
+typedef struct {
+    uint32_t address;           ///< first page not flashed yet
+    uint32_t check;             ///< ~address, tells a journal from random EEPROM data
+} journal_t;
 
 
 // Variables
 
-/**
- * Boot signature.
- * Registers r2 and r3 are used to switch between bootloader and app at
- * reset time.
- */
-register uint8_t r2 asm("r2");
-register uint8_t r3 asm("r3");
-
-volatile uint8_t tx_buffer[TX_BUFFER_LEN];  ///< UART transmit buffer
-volatile uint8_t rx_buffer[RX_BUFFER_LEN];  ///< UART receive buffer
-volatile uint8_t rx_head, rx_tail, tx_head, tx_tail;
-volatile uint8_t uart_error;                ///< one of #ERROR_RX_DATA_OVERRUN, #ERROR_RX_FRAME_ERROR or #ERROR_RX_BUFFER_OVERFLOW   
-volatile uint16_t clock;                    ///< number of milliseconds since boot */
-volatile uint16_t t0;
-volatile int16_t breathing_led;
+volatile uint32_t t0;
+volatile uint32_t idle0;                    ///< #stats idle time at #t0
 
 char line[MAX_LINE_LEN];        ///< Buffer containing hex lines or commands
 uint8_t page[PAGE_SIZE];        ///< Buffer containing the current page (to be flashed or verified)
 addr_t last_address;            ///< Keep track of the last address flashed
 uint32_t address_extension;     ///< To be added to the address low 16 bits (02 or 04 ihex records)
-
-///////////////////////////////////////////////////////////////////////
-// ISR routines 
-///////////////////////////////////////////////////////////////////////
-
-/**
- * UART RX ISR.
- * Called when the hardware UART receives a byte.
- */
-ISR(USART_RX_vect)
-{
-    // UCSR0A must be read before UDR0
-    uint8_t status = UCSR0A;
-    uint8_t data = UDR0;    // this clears the interrupt flag
-    uint8_t new_head = (rx_head + 1) % RX_BUFFER_LEN;
-
-    if (status & _BV(DOR0))
-        uart_error |= ERROR_RX_DATA_OVERRUN;
-    if (status & _BV(FE0))
-        uart_error |= ERROR_RX_FRAME_ERROR;
-
-    // If head meets tail -> overflow and ignore the received byte
-    if (new_head == rx_tail) {
-        uart_error |= ERROR_RX_BUFFER_OVERFLOW;
-    }
-    else {
-        rx_buffer[rx_head] = data;
-        rx_head = new_head;
-    }
-    // delay watchdog reboot while pending rx data
-    wdt_reset();
-}
-
-/**
- * UART Data Register Empty ISR.
- * Called when the UART is ready to accept a new byte for transmission.
- */
-ISR(USART_UDRE_vect)
-{
-    if (tx_head == tx_tail) {
-        // Buffer is empty, disable UDRE int
-        UCSR0B &= ~_BV(UDRIE0);
-    }
-    else {
-        // Send byte
-        UDR0 = tx_buffer[tx_tail];
-        tx_tail = (tx_tail + 1) % TX_BUFFER_LEN;
-    }
-    // delay the reboot until no more pending tx
-    wdt_reset();
-}
-
-/**
- * Timer 0 comparator A ISR.
- * Called when timer 0 counts up to OCR0A. This is used to keep track
- * of time and also for the breathing LED (software PWM).
- */
-ISR(TIMER0_COMPA_vect)
-{
-    uint16_t c = ++clock;
-    
-    LED_ON();
-    if ((c % 8) == 0) {
-        // breath in the lower half brightness range of the led (0 .. OCR0A / 2)
-        if (++breathing_led > OCR0A) breathing_led = 0;
-        if (breathing_led < OCR0A / 2)
-            OCR0B = breathing_led;
-        else
-            OCR0B = OCR0A - breathing_led;
-    }
-}
-
-/**
- * Time 0 comparator B ISR.
- * Called when timer 0 counts up to OCR0B. This is used for the breathing
- * LED (software PWM). It is declared naked because it doesn't change
- * registers or SREG.
- */
-ISR(TIMER0_COMPB_vect, ISR_NAKED)
-{
-    LED_OFF();
-    reti();
-}
-
-/**
- * SPM ready ISR.
- * Called when the SPM instruction is done. It just disables SPMIE
- * so that it doesn't get called infinitely.
- */
-ISR(SPM_READY_vect)
-{
-    boot_spm_interrupt_disable();
-}
-
+addr_t resume_address;          ///< Page where a failed upload can be resumed, 0 if none
+uint8_t partial_upload;         ///< Uploads may start at any address (see #compare_pages)
 
 ///////////////////////////////////////////////////////////////////////
 // Conversion utils
@@ -199,7 +71,7 @@ uint16_t hex_nibbles(char *s, uint8_t n)
             r += *s - '0';
         else if (*s >= 'A' && *s <= 'F')
             r += *s - 'A' + 10;
-        else if (*s >= 'a' && *s <= 'a')
+        else if (*s >= 'a' && *s <= 'f')
             r += *s - 'a' + 10;
         s++;
         n--;
@@ -207,92 +79,28 @@ uint16_t hex_nibbles(char *s, uint8_t n)
     return r;
 }
 
-
-///////////////////////////////////////////////////////////////////////
-// Timing functions 
-///////////////////////////////////////////////////////////////////////
-
-/**
- * Start the timer.
- * Use the timer in CTC (clear timer on compare) mode to count up to OCR0A
- * and generate interrupts on both OCR0A/OCR0B matches.
- *
- * With a prescaler = 64, OCR0A = 249 and CPU clock = 16 MHz, the period
- * is 0.996ms (~ 1ms).
- */
-void timer_init(void)
-{
-    TCCR0A = _BV(WGM01);                // CTC mode (count up to OCR0A)
-    OCR0A = 249;                        // 249 * 64 / 16M = 0.996 ms
-    TCCR0B = _BV(CS01) | _BV(CS00);     // clk/64 prescaler
-    TIMSK0 = _BV(OCIE0A) | _BV(OCIE0B); // Interrupt on both A, B match
-}
-
 /**
- * Current time in ms.
- * @return the number of milliseconds since reset
+ * Base64 digit.
+ * @param x 6 lower bits to encode
+ * @return the base64 ascii character
  */
-uint16_t millis(void)
+char base64_char(uint8_t x)
 {
-    uint16_t m;
-    cli();      // read atomically
-    m = clock;
-    sei();
-    return m;
+    x &= 0x3f;
+    if (x < 26)
+        return x + 'A';
+    if (x < 52)
+        return x - 26 + 'a';
+    if (x < 62)
+        return x - 52 + '0';
+    return x == 62 ? '+' : '/';
 }
 
 
 ///////////////////////////////////////////////////////////////////////
-// UART functions
+// UART output
 ///////////////////////////////////////////////////////////////////////
 
-/**
- * Start the UART.
- * Set the UART to 2x speed mode, BAUD_RATE bauds, 8N1 and enable rx 
- * interrupts.
- */
-void uart_init(void)
-{
-    // Set baud rate
-    UBRR0 = SERIAL_2X_UBRRVAL(BAUD_RATE);
-
-    // double speed
-    UCSR0A = _BV(U2X0);
-
-    // 8,N,1
-    UCSR0C = (3 << UCSZ00);
-
-    // Enable receiver and transmitter, generate interrupts on RX, DRE
-    UCSR0B = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
-}
-
-/**
- * Send a byte.
- * If the tx queue is full, it will sleep (ie. block) until space becomes
- * available.
- * @param c the byte
- */
-void uart_send_byte(uint8_t c)
-{
-    uint16_t new_head = (tx_head + 1) % TX_BUFFER_LEN;
-
-    IDLE_WHILE(tx_tail == new_head);
-
-    tx_buffer[tx_head] = c;
-    tx_head = new_head;
-
-    // Enable UDRE int, this will trigger the UDRE ISR
-    UCSR0B |= _BV(UDRIE0);
-}
-
-/**
-  * Flush the tx buffer.
-  */
-void uart_flush(void)
-{
-    IDLE_WHILE(tx_tail != tx_head);
-}
-
 /**
  * Send a PROGMEM string.
  * @param s the string, which *must* be in program space
@@ -336,26 +144,60 @@ void uart_send_hex(uint16_t x, uint8_t n)
 }
 
 /**
- * Receive a byte.
- * @return an int16_t with the byte, will block until data is available.
+ * Print out a flash address in hexadecimal.
+ * @param address the address
  */
-uint8_t uart_recv_byte(void) 
+void uart_send_hex_addr(addr_t address)
 {
-    IDLE_WHILE(rx_tail == rx_head);
+#if FLASH_SIZE > 65536
+    uart_send_hex(address >> 16, 1);
+#endif
+    uart_send_hex(address, 4);
+}
 
-    int8_t c = rx_buffer[rx_tail];
-    rx_tail = (rx_tail + 1) % RX_BUFFER_LEN;
+/**
+ * Send n lower bytes of x in little endian binary.
+ * @param x x
+ * @param n number of bytes
+ */
+void uart_send_le(uint32_t x, uint8_t n)
+{
+    while (n--) {
+        uart_send_byte(x);
+        x >>= 8;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Resume journal
+///////////////////////////////////////////////////////////////////////
 
-    return c;
+/**
+ * Load #resume_address from the EEPROM journal.
+ * Anything but a page aligned address below #NRWW_START with a matching
+ * check reads as 0 (no upload to resume).
+ */
+void load_resume_point(void)
+{
+    journal_t journal;
+    eeprom_read(&journal, JOURNAL, sizeof(journal));
+    if (journal.check == ~journal.address && journal.address < NRWW_START
+            && journal.address % PAGE_SIZE == 0)
+        resume_address = journal.address;
+    else
+        resume_address = 0;
 }
 
 /**
- * Check if there is incoming data over the UART.
- * @return true if data available
+ * Store #resume_address in the EEPROM journal.
+ * Only changed bytes are written, so this is cheap when nothing changed.
  */
-int8_t uart_available(void)
+void save_resume_point(void)
 {
-    return (rx_tail != rx_head);
+    journal_t journal;
+    journal.address = resume_address;
+    journal.check = ~journal.address;
+    eeprom_write(&journal, JOURNAL, sizeof(journal));
 }
 
 
@@ -363,41 +205,26 @@ int8_t uart_available(void)
 // Reboot functions
 ///////////////////////////////////////////////////////////////////////
 
-/** Force a reboot.
- * Reboots the AVR by setting the watchdog timer. Interrupts are
- * allowed, so that pending rx or tx data gets flushed.
- */
-void __attribute__((noreturn)) reboot(void) {
-    // There is a 70-90 ms bluetooth 'silence' after the 1 KB or so is
-    // received. In order to flush a possibly long paste, set the watchdog
-    // timer to reboot after 120 ms of inactivity.
-    wdt_enable(WDTO_120MS);
-    for (;;) {
-        sleep_cpu();
-    }
-}
-
 /** Reboot to bootloader.
  * Sets a 15 ms watchdog timer and idles until the watchdog reboots
  * the AVR. Registers r2 = r3 = 0 are used to signal bootloader run.
+ * The pages flashed so far are journaled, so that an upload that failed
+ * can be resumed.
  */
 void __attribute__((noreturn)) reboot_to_bootloader(void)
 {
+    save_resume_point();
     uart_send_string(P("Rebooting into bootloader\r\n\r\n"));
-    r2 = r3 = 0;
-    reboot();
+    reboot(0);
 }
 
 /** Reboot to user app.
- * Sets a 15 ms watchdog timer and idles until the watchdog reboots
- * the AVR. Registers r2/r3 = 0xb0aa are used to signal app run.
+ * Jumps into the app once the serial line is quiet (see #reboot).
  */
 void __attribute__((noreturn)) reboot_to_app(void)
 {
     uart_send_string(P("Enjoy!\r\n\r\n"));
-    r2 = BOOTAPP_SIG_1;
-    r3 = BOOTAPP_SIG_2;
-    reboot();
+    reboot(1);
 }
 
 
@@ -453,7 +280,7 @@ uint8_t get_line(void)
             return 1;
         }
     }
-    else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == ':') {
+    else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == ':' || c == ' ') {
         if (len < MAX_LINE_LEN - 1) {
             line[len++] = c;
             if (line[0] != ':') {   // no echo if receiving hex
@@ -468,6 +295,49 @@ uint8_t get_line(void)
     return 0;
 }
 
+/**
+ * Parse an optional hex argument of a command.
+ * Leading spaces are skipped and hex digits are decoded up to the next
+ * space or the end of the line.
+ * @param s pointer to the parsing position, moved past the argument
+ * @param value default value, returned if there are no more arguments
+ * @return the decoded argument
+ */
+uint32_t parse_hex_arg(char **s, uint32_t value)
+{
+    while (**s == ' ')
+        (*s)++;
+    if (**s) {
+        value = 0;
+        while (**s && **s != ' ') {
+            value = (value << 4) | hex_nibbles(*s, 1);
+            (*s)++;
+        }
+    }
+    return value;
+}
+
+/**
+ * Parse an optional "start length" flash range of a command.
+ * Both arguments are hex, the range defaults to the whole flash and is
+ * clamped to #FLASH_SIZE.
+ * @param start set to the first address of the range
+ * @param end set to the address past the end of the range
+ */
+void parse_range(addr_t *start, addr_t *end)
+{
+    char *s = line + 1;
+    uint32_t first = parse_hex_arg(&s, 0);
+    uint32_t len = parse_hex_arg(&s, FLASH_SIZE);
+
+    if (first > FLASH_SIZE)
+        first = FLASH_SIZE;
+    if (len > FLASH_SIZE - first)
+        len = FLASH_SIZE - first;
+    *start = first;
+    *end = first + len;
+}
+
 /**
  * Show a comand prompt.
  */
@@ -517,6 +387,25 @@ void new_page(void)
         page[i] = 0xff;
 }
 
+/**
+ * Account for the duration of an SPM operation.
+ * @param timing the timing stats to update
+ * @param t0 start of the operation, in ticks
+ * @return the current time in ticks
+ */
+uint32_t time_spm(volatile spm_timing_t *timing, uint32_t t0)
+{
+    uint32_t t = ticks();
+    uint16_t d = t - t0;
+
+    if (d > timing->max)
+        timing->max = d;
+    if (d < timing->min || timing->min == 0)
+        timing->min = d;
+    timing->total += d;
+    return t;
+}
+
 /**
  * Flash the current page.
  * Writes the current page at #current_page from the data in
@@ -525,38 +414,24 @@ void new_page(void)
 void write_current_page(addr_t current_page)
 {
     const addr_t addr = current_page * PAGE_SIZE;
-    uint16_t i;
-
-    // All operations involving SPM are timed sequences and must be protected
-    // from interrupts with cli()/sei(), ie. boot_page_*.
-    cli();
-    boot_page_erase(addr);          // erase page
-    boot_spm_interrupt_enable();    // let SPM-ready interrupt wake us up
-    sei();
-
-    IDLE_WHILE(boot_spm_busy());    // sleep until SPM is done
-
-    for (i = 0; i < PAGE_SIZE; i += 2) {
-        // make little endian words by swapping every two bytes
-        uint16_t word = page[i] | (page[i+1] << 8);
-        cli();
-        boot_page_fill(addr + i, word);
-        // no need to IDLE_WAIT(boot_spm_busy()) here
-        sei();
-    }
-
-    cli();
-    boot_page_write(addr);          // write page
-    boot_spm_interrupt_enable();    // let SPM-ready int wake us up
-    sei();
-
-    IDLE_WHILE(boot_spm_busy());    // sleep until SPM done
+    uint32_t t = ticks();
+
+    trace(TRACE_ERASE_START);
+    flash_erase_page(addr);
+    trace(TRACE_ERASE_END);
+    t = time_spm(&stats.erase, t);
+
+    trace(TRACE_WRITE_START);
+    flash_write_page(addr, page);
+    trace(TRACE_WRITE_END);
+    time_spm(&stats.write, t);
+    stats.pages++;
 }
 
 /**
  * Validate an address.
- * Addresses in the ihex file must start at 0 and be monotonically 
- * increasing.
+ * Addresses in the ihex file must start at 0 (or within the page at
+ * #resume_address) and be monotonically increasing.
  * @param last_address last address
  * @param address currant address
  * @return true if valid
@@ -570,14 +445,15 @@ uint8_t is_address_valid(addr_t address)
         return 0;
     }
 
-    if (last_address == -(addr_t)1 && address != 0) {
+    if (last_address == (addr_t)-1 && address != 0 && !partial_upload && (resume_address == 0
+            || address / PAGE_SIZE != resume_address / PAGE_SIZE)) {
         uart_send_string(P("\r\nFirst address must be 0:\r\n"));
         dump_line();
         point_out_error(3, 4);
         return 0;
     }
 
-    if (last_address != -(addr_t)1 && address < last_address) {
+    if (last_address != (addr_t)-1 && address < last_address) {
         uart_send_string(P("\r\nAddresses must be increasing:\r\n"));
         dump_line();
         point_out_error(3, 4);
@@ -628,6 +504,9 @@ uint8_t flash_hex_line(uint8_t mode)
     uint8_t record_type;
     int i;
 
+    stats.lines++;
+    trace(TRACE_LINE);
+
     if (! is_checksum_valid()) {
         uart_send_string(P("\r\nChecksum error in line:\r\n"));
         dump_line();
@@ -659,11 +538,11 @@ uint8_t flash_hex_line(uint8_t mode)
             write_current_page(last_address / PAGE_SIZE);
 
             // re-enable RWW area
-            cli();
-            boot_rww_enable();
-            boot_spm_interrupt_enable();
-            sei();
-            IDLE_WHILE(boot_spm_busy());
+            flash_rww_enable();
+
+            // nothing left to resume
+            resume_address = 0;
+            save_resume_point();
         }
         // prepare for verify: reset address extension
         address_extension = 0;
@@ -676,16 +555,22 @@ uint8_t flash_hex_line(uint8_t mode)
         if (! is_address_valid(extended_address))
             return FLASH_ERROR;
 
+        if (mode == MODE_FLASH && last_address == (addr_t)-1) {
+            // 0 on new uploads, the resumed page otherwise
+            resume_address = extended_address / PAGE_SIZE * PAGE_SIZE;
+        }
+
         for (i = 0; i < count; i++) {
             uint8_t b = hex_nibbles(line + 9 + i * 2, 2);
 
             if (mode == MODE_FLASH) {
                 addr_t last_page = last_address / PAGE_SIZE;
                 addr_t current_page = (extended_address + i) / PAGE_SIZE;
-                if (last_page != current_page && last_address != -(addr_t)1) {
+                if (last_page != current_page && last_address != (addr_t)-1) {
                     // current page is ready to write
                     write_current_page(last_page);
                     new_page();
+                    resume_address = current_page * PAGE_SIZE;
                 }
                 page[(address + i) % PAGE_SIZE] = b;
             }
@@ -707,18 +592,223 @@ uint8_t flash_hex_line(uint8_t mode)
 }
 
 /**
- * Dump the entire flash contents.
+ * Check if a flash range is erased.
+ * @param address first address
+ * @param n number of bytes
+ * @return true if all the bytes are 0xff
  */
-void dump_flash(void)
+uint8_t is_blank(addr_t address, uint16_t n)
 {
-    uint8_t checksum = 0;
-    addr_t address;
-    for (address = 0; address < FLASH_SIZE; address++) {
-        uint8_t b;
+    while (n--) {
+        if (R(address++) != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Find the end of the application.
+ * Scans the flash downwards from #NRWW_START for the first non erased
+ * byte.
+ * @return the address past the highest non-0xff byte, 0 if empty
+ */
+addr_t used_extent(void)
+{
+    addr_t address = NRWW_START;
+    while (address > 0 && R(address - 1) == 0xff)
+        address--;
+    return address;
+}
+
+/**
+ * Report the flash in use by the application.
+ * @param bitmap if true, also send a bitmap of the non-blank pages below
+ *     #NRWW_START in hex, 4 pages per digit, the first page being the
+ *     most significant bit
+ */
+void report_used(uint8_t bitmap)
+{
+    addr_t end = used_extent();
+
+    uart_send_string(P("Used "));
+    uart_send_int(end);
+    if (end) {
+        uart_send_string(P(" bytes, last "));
+        uart_send_hex_addr(end - 1);
+    }
+    else {
+        uart_send_string(P(" bytes"));
+    }
+    uart_send_string(P(CRLF));
+
+    if (bitmap) {
+        uint16_t pg;
+        for (pg = 0; pg < NRWW_START / PAGE_SIZE; pg += 4) {
+            uint8_t nibble = 0;
+            uint8_t j;
+            for (j = 0; j < 4; j++)
+                nibble = (nibble << 1) | !is_blank((addr_t)(pg + j) * PAGE_SIZE, PAGE_SIZE);
+            uart_send_hex(nibble, 1);
+        }
+        uart_send_string(P(CRLF));
+    }
+}
+
+/**
+ * CRC-16/XMODEM of a flash range.
+ * @param address first address
+ * @param n number of bytes
+ * @return the crc
+ */
+uint16_t crc_flash(addr_t address, uint16_t n)
+{
+    uint16_t crc = 0;
+    while (n--)
+        crc = _crc_xmodem_update(crc, R(address++));
+    return crc;
+}
+
+/**
+ * Compare flash pages against their expected CRCs.
+ * The command takes a hex page number followed by the hex
+ * CRC-16/XMODEM of that page and the next ones, 4 digits each. It replies
+ * with a hex bitmap of the pages which differ, 4 pages per digit, the
+ * first page being the most significant bit.
+ *
+ * It also lets the next uploads start at any address, so that the host
+ * only needs to send the pages which differ.
+ */
+void compare_pages(void)
+{
+    char *s = line + 1;
+    uint16_t pg = parse_hex_arg(&s, 0);
+    uint8_t nibble = 0;
+    uint8_t bits = 0;
+
+    for (;;) {
+        while (*s == ' ')
+            s++;
+        if (!s[0] || !s[1] || !s[2] || !s[3] || pg >= NRWW_START / PAGE_SIZE)
+            break;
+        nibble = (nibble << 1)
+            | (hex_nibbles(s, 4) != crc_flash((addr_t)pg * PAGE_SIZE, PAGE_SIZE));
+        s += 4;
+        pg++;
+        if (++bits == 4) {
+            uart_send_hex(nibble, 1);
+            nibble = bits = 0;
+        }
+    }
+    if (bits)
+        uart_send_hex(nibble << (4 - bits), 1);
+    uart_send_string(P(CRLF));
+
+    partial_upload = 1;
+}
+
+/**
+ * Send a flash range in base64.
+ * @param address first address
+ * @param n number of bytes
+ */
+void uart_send_base64(addr_t address, uint16_t n)
+{
+    while (n) {
+        uint8_t k = n < 3 ? n : 3;
+        uint32_t bits = 0;
+        uint8_t i;
+
+        for (i = 0; i < 3; i++) {
+            bits <<= 8;
+            if (i < k)
+                bits |= R(address + i);
+        }
+        // k bytes take k + 1 digits, pad the rest with '='
+        for (i = 0; i < 4; i++) {
+            uart_send_byte(i <= k ? base64_char(bits >> 18) : '=');
+            bits <<= 6;
+        }
+        address += k;
+        n -= k;
+    }
+}
+
+/**
+ * Read out a flash range in page sized frames.
+ * Every frame covers the range part within a flash page and carries the
+ * CRC-16/XMODEM of its data. An empty frame at the end address terminates
+ * the readout.
+ *
+ * Binary frames are: address (4 bytes), length (2 bytes), data, crc
+ * (2 bytes), all little endian. Text frames are lines with the hex
+ * address, the base64 data and the hex crc separated by spaces.
+ *
+ * @param address first address
+ * @param end address past the last one
+ * @param binary true for binary frames, false for text (base64)
+ */
+void readout_flash(addr_t address, addr_t end, uint8_t binary)
+{
+    for (;;) {
+        uint16_t n = PAGE_SIZE - address % PAGE_SIZE;
+        uint16_t crc;
+
+        if (n > end - address)
+            n = end - address;
+        crc = crc_flash(address, n);
+
+        if (binary) {
+            uint16_t i;
+            uart_send_le(address, 4);
+            uart_send_le(n, 2);
+            for (i = 0; i < n; i++)
+                uart_send_byte(R(address + i));
+            uart_send_le(crc, 2);
+        }
+        else {
+            uart_send_hex_addr(address);
+            uart_send_byte(' ');
+            uart_send_base64(address, n);
+            uart_send_byte(' ');
+            uart_send_hex(crc, 4);
+            uart_send_string(P(CRLF));
+        }
+
+        if (n == 0)
+            break;
+        address += n;
+    }
+}
+
+/**
+ * Dump a flash range in ihex format.
+ * Records are aligned to 16 bytes. 04 records are only emitted when the
+ * upper 16 address bits change.
+ * @param address first address
+ * @param end address past the last one
+ * @param sparse if true, skip records which are all 0xff (erased)
+ */
+void dump_flash(addr_t address, addr_t end, uint8_t sparse)
+{
+#if FLASH_SIZE > 65536
+    uint16_t segment = 0;
+#endif
+    while (address < end) {
+        uint8_t count = 16 - address % 16;
+        uint8_t checksum;
+        uint8_t i;
+
+        if (count > end - address)
+            count = end - address;
+
+        if (sparse && is_blank(address, count)) {
+            address += count;
+            continue;
+        }
 #if FLASH_SIZE > 65536
-        if (address % 0x10000 == 0) {
+        if ((address >> 16) != segment) {
             // Emit a 04 record (extended linear address) on 16-higher-bits change
-            uint16_t segment = address >> 16;
+            segment = address >> 16;
             uart_send_string(P("\r\n:02"));
             uart_send_hex(0x0000, 4);       // address (16 bit), ignored
             uart_send_hex(0x04, 2);         // record type 04
@@ -727,23 +817,117 @@ void dump_flash(void)
             uart_send_hex(checksum, 2);
         }
 #endif
-        if (address % 16 == 0) {
-            uart_send_string(P("\r\n:10"));
-            uart_send_hex(address, 4);
-            uart_send_hex(0, 2);
-            checksum = - 0x10 - (address >> 8) - (address & 0xff);
-        }
-        b = R(address);
-        uart_send_hex(b, 2);
-        checksum -= b;
-        if (address % 16 == 15) {
-            uart_send_hex(checksum, 2);
+        uart_send_string(P("\r\n:"));
+        uart_send_hex(count, 2);
+        uart_send_hex(address, 4);
+        uart_send_hex(0, 2);
+        checksum = - count - (address >> 8) - (address & 0xff);
+        for (i = 0; i < count; i++) {
+            uint8_t b = R(address + i);
+            uart_send_hex(b, 2);
+            checksum -= b;
         }
+        uart_send_hex(checksum, 2);
+        address += count;
     }
     uart_send_string(P("\r\n:00000001FF\r\n"));
 }
 
 
+///////////////////////////////////////////////////////////////////////
+// Statistics
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Print an SPM timing as min/avg/max microseconds.
+ * @param name the operation name
+ * @param timing the timing stats
+ */
+void print_spm_timing(char const name[], volatile spm_timing_t *timing)
+{
+    uart_send_string(name);
+    uart_send_int((uint32_t)timing->min * US_PER_TICK);
+    uart_send_byte('/');
+    uart_send_int(stats.pages ? timing->total * US_PER_TICK / stats.pages : 0);
+    uart_send_byte('/');
+    uart_send_int((uint32_t)timing->max * US_PER_TICK);
+    uart_send_string(P(" us\r\n"));
+}
+
+/**
+ * Print the share of time spent asleep.
+ * @param idle milliseconds asleep
+ * @param total milliseconds elapsed
+ */
+void print_idle(uint32_t idle, uint32_t total)
+{
+    uart_send_string(P("idle "));
+    uart_send_int(total ? idle * 100 / total : 100);
+    uart_send_byte('%');
+}
+
+/**
+ * Print the performance counters.
+ */
+void print_stats(void)
+{
+    uint32_t now = millis();
+
+    uart_send_string(P("rx max "));
+    uart_send_int(stats.rx_max);
+    uart_send_byte('/');
+    uart_send_int(RX_BUFFER_LEN - 1);
+    uart_send_string(P(", frame errors "));
+    uart_send_int(stats.frame_errors);
+    uart_send_string(P(", overruns "));
+    uart_send_int(stats.overruns);
+    uart_send_string(P(", tx stalls "));
+    uart_send_int(stats.tx_stalls);
+    uart_send_string(P("\r\nlines "));
+    uart_send_int(stats.lines);
+    uart_send_string(P(", pages "));
+    uart_send_int(stats.pages);
+    uart_send_string(P(", stack free "));
+    uart_send_int(stack_free());
+    uart_send_string(P(" of "));
+    uart_send_int(stack_size());
+    uart_send_string(P(CRLF));
+    print_spm_timing(P("erase min/avg/max "), &stats.erase);
+    print_spm_timing(P("write min/avg/max "), &stats.write);
+    print_idle(idle_millis(), now);
+    uart_send_string(P(" of "));
+    uart_send_int(now);
+    uart_send_string(P(" ms\r\n"));
+}
+
+
+/**
+ * Dump and clear the trace.
+ * Sends a line per event, oldest first, with the timestamp in 4 us ticks
+ * (hex), the event type and the #rx_buffer level. See
+ * tools/trace2chrome.c to turn it into a timeline.
+ */
+void dump_trace(void)
+{
+    uint8_t i = (trace_head + TRACE_LEN - trace_count) % TRACE_LEN;
+
+    trace_paused = 1;
+    while (trace_count) {
+        trace_t *e = &trace_ring[i];
+        uart_send_hex(e->epoch, 2);
+        uart_send_hex(e->time, 4);
+        uart_send_byte(' ');
+        uart_send_byte(e->type);
+        uart_send_byte(' ');
+        uart_send_int(e->rx_level);
+        uart_send_string(P(CRLF));
+        i = (i + 1) % TRACE_LEN;
+        trace_count--;
+    }
+    trace_paused = 0;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 // Bootloader sequence
 ///////////////////////////////////////////////////////////////////////
@@ -761,14 +945,51 @@ void run_command(void)
             reboot_to_bootloader();
             break;
         case 'd':
-            dump_flash();
+        case 'D': {
+            addr_t start, end;
+            parse_range(&start, &end);
+            dump_flash(start, end, line[0] == 'd');
+            prompt();
+            break;
+        }
+        case 'b':
+        case 'B': {
+            addr_t start, end;
+            parse_range(&start, &end);
+            readout_flash(start, end, line[0] == 'B');
+            prompt();
+            break;
+        }
+        case 's':
+            print_stats();
+            prompt();
+            break;
+        case 't':
+            dump_trace();
+            prompt();
+            break;
+        case 'c':
+            compare_pages();
+            prompt();
+            break;
+        case 'u':
+        case 'U':
+            report_used(line[0] == 'U');
             prompt();
             break;
         case 'h':
             uart_send_string(P(
                 " q\treboot to app\r\n"
                 " r\treboot to bootloader\r\n"
-                " d\tdump flash in hex format\r\n"
+                " d [a [n]]\tdump n bytes of flash at a in hex format\r\n"
+                " D [a [n]]\tsame, including erased rows\r\n"
+                " b [a [n]]\tread out flash in base64 frames\r\n"
+                " B [a [n]]\tread out flash in binary frames\r\n"
+                " u\tshow flash used by the app\r\n"
+                " U\tsame, plus a bitmap of used pages\r\n"
+                " c p h..\tlist pages from p whose crc isn't h..\r\n"
+                " s\tshow performance counters\r\n"
+                " t\tdump and clear the event trace\r\n"
                 " esc\tabort current command\r\n"
             ));
             prompt();
@@ -791,28 +1012,25 @@ void __attribute__((noreturn)) bootloader(void)
     uint8_t flash_status;
     uint8_t mode;
 
-    // Move ISR vector table to the bootloader
-    MCUCR = _BV(IVCE);
-    MCUCR = _BV(IVSEL);
-
-    // init led pin direction
-    INIT_LED();
-
-    // init sleep mode, uart and timer
-    power_init();
-    uart_init();
-    timer_init();
-    sei();
+    hal_init();
+    trace(TRACE_BOOT);
 
     // prepare a new empty page
     new_page();
 
+    load_resume_point();
+
     // Run through the two modes: first flash, then verify
     for (mode = MODE_FLASH; mode <= MODE_VERIFY; mode++) {
         if (mode == MODE_FLASH) {
             uart_send_string(P(
                 "AVR Hexloader " VERSION " git " GIT_VERSION "\r\n"
                 "Paste your hex file, 'h' for help\r\n"));
+            if (resume_address) {
+                uart_send_string(P("Last upload failed, paste from "));
+                uart_send_hex_addr(resume_address);
+                uart_send_string(P(" to resume\r\n"));
+            }
         }
         else {
             uart_send_string(P("Paste again to verify\r\n"));
@@ -820,13 +1038,21 @@ void __attribute__((noreturn)) bootloader(void)
         prompt();
 
         new_page();
-        last_address = -(addr_t)1;
+        last_address = (addr_t)-1;
+        address_extension = 0;
         flash_status = FLASH_WAITING;
         do {
+            // entered by accident? boot the app if nobody is typing
+            if (AUTOBOOT_MS && flash_status == FLASH_WAITING && !uart_wait(AUTOBOOT_MS)
+                    && !is_blank(0, 2)) {
+                uart_send_string(P("No input, "));
+                reboot_to_app();
+            }
             if (get_line()) {
                 if (line[0] == ':') {
                     if (flash_status == FLASH_WAITING) {
                         t0 = millis();
+                        idle0 = idle_millis();
                     }
                     flash_status = flash_hex_line(mode);
                 }
@@ -842,36 +1068,11 @@ void __attribute__((noreturn)) bootloader(void)
 
         uart_send_string(P(" OK! ("));
         uart_send_int(millis() - t0);
-        uart_send_string(P("ms)\r\n"));
+        uart_send_string(P("ms, rx max "));
+        uart_send_int(stats.rx_max);
+        uart_send_string(P(", "));
+        print_idle(idle_millis() - idle0, millis() - t0);
+        uart_send_string(P(")\r\n"));
     }
     reboot_to_app();
 }
-
-/**
- * Entry point.
- * Decides whether to run the bootloader or the user app.
- */
-void __attribute__((noreturn)) main(void) {
-    // Disable the watchdog if set
-    uint8_t mcusr = MCUSR;
-    if (mcusr & _BV(WDRF)) {
-        MCUSR = mcusr & ~_BV(WDRF);
-        wdt_disable();
-    }
-
-    // Boot into app if
-    // (just powered on (no external or watchdog reset), 
-    // OR bootloader 0xb0aa signature found (boot into app))
-    // AND (program memory is not empty)
-    if ((!(mcusr & (_BV(EXTRF) | _BV(WDRF))) || BOOT_APP())
-            && pgm_read_word_near(0) != 0xffff) {
-        r2 = r3 = 0;
-        asm("jmp 0");               // go to app
-        __builtin_unreachable();    // suppress 'noreturn does return' warning
-    }
-    else {
-        r2 = BOOTAPP_SIG_1;
-        r3 = BOOTAPP_SIG_2;
-        bootloader();
-    }
-}
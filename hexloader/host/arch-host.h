@@ -0,0 +1,56 @@
+#pragma once
+
+/**
+ * Simulated chip for host builds.
+ * Same memory layout as the real chips in ../arch.h, with the flash
+ * being an array in RAM (see hal-host.c). Build with -DHOST and either
+ * -DHOST_MCU_328p or -DHOST_MCU_2560.
+ */
+
+#include <stdint.h>
+
+#ifdef HOST_MCU_328p
+
+#define FLASH_SIZE                  0x8000          ///< atmega328p total flash
+#define NRWW_START                  0x7000          ///< can't flash beyond this while uart code runs
+#define PAGE_SIZE                   0x80            ///< atmega328p page size
+#define TRACE_LEN                   48              ///< trace events kept in SRAM
+#define E2END                       0x3ff           ///< last EEPROM address
+
+typedef uint16_t addr_t;
+
+#elif defined(HOST_MCU_2560)
+
+#define FLASH_SIZE                  0x40000         ///< atmega2560 total flash
+#define NRWW_START                  0x3e000         ///< can't flash beyond this while uart code runs
+#define PAGE_SIZE                   0x100           ///< atmega2560 page size
+#define TRACE_LEN                   200             ///< trace events kept in SRAM
+#define E2END                       0xfff           ///< last EEPROM address
+
+typedef uint32_t addr_t;
+
+#else
+#error "Use -DHOST_MCU_328p or -DHOST_MCU_2560"
+#endif
+
+extern uint8_t sim_flash[FLASH_SIZE];   ///< simulated flash
+
+#define P(x) (x)
+#define R(x) (sim_flash[(addr_t)(x)])
+
+/**
+ * CRC-16/XMODEM update, same as avr-libc's <util/crc16.h>.
+ */
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+    int i;
+
+    crc = crc ^ ((uint16_t)data << 8);
+    for (i = 0; i < 8; i++) {
+        if (crc & 0x8000)
+            crc = (crc << 1) ^ 0x1021;
+        else
+            crc <<= 1;
+    }
+    return crc;
+}
@@ -0,0 +1,259 @@
+/**
+ * Host microbenchmark of the bootloader core.
+ *
+ * Feeds hex files to bootloader() through the host HAL and measures how
+ * fast the core decodes, assembles pages, verifies and reads the flash
+ * back, with no UART or SPM in the way:
+ *
+ *     bench [-n runs] [-w baseline | -c baseline [-t percent]] file.hex...
+ *
+ * Every file is flashed (pasted once), then flashed and verified (pasted
+ * twice), and flashed and read back with 'b' and 'B', each mode's time
+ * being the difference with the flash alone. Times are the best of the
+ * runs.
+ *
+ * -w saves the results as a baseline, one line per file, and -c compares
+ * against one: a result that changed, or a time more than -t percent
+ * (default 25) slower than the baseline fails the run. Baselines are
+ * only meaningful on the machine that recorded them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+#define MODES               4       ///< flash, verify, base64 and binary readout
+#define MIN_REGRESSION_MS   0.02    ///< slowdowns below this are noise, whatever the percentage
+
+static char const *mode_names[MODES] = { "flash", "verify", "base64", "binary" };
+
+/** Results for a file. */
+typedef struct {
+    char image[64];                 ///< file name, without the directory
+    char result[8];                 ///< "ok" or "error"
+    double ms[MODES];               ///< time of each mode
+} result_t;
+
+/**
+ * Wall clock in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Read a whole file.
+ * @param path file name
+ * @param len set to the file length
+ * @return the contents (malloc'ed), NULL on error
+ */
+static char *read_file(char const *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long n;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    rewind(f);
+    buf = malloc(2 * n + 64);     // room for a second paste or a command
+    if (buf && fread(buf, 1, n, f) != (size_t)n) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+/**
+ * Count the occurrences of a string in the session output.
+ */
+static int output_count(char const *s)
+{
+    size_t len, n = strlen(s), i;
+    char const *out = host_output(&len);
+    int count = 0;
+
+    for (i = 0; i + n <= len; i++)
+        if (memcmp(out + i, s, n) == 0)
+            count++;
+    return count;
+}
+
+/**
+ * Time a session, best of runs.
+ * @return seconds
+ */
+static double time_run(char const *input, size_t len, int runs)
+{
+    double best = 1e9;
+
+    while (runs--) {
+        double t;
+        host_reset();
+        t = now();
+        host_run(input, len);
+        t = now() - t;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+/**
+ * Find a file's baseline.
+ * @return 0 if found
+ */
+static int load_baseline(char const *path, char const *image, result_t *base)
+{
+    FILE *f = fopen(path, "r");
+    char buf[256];
+    int found = -1;
+
+    if (!f)
+        return -1;
+    while (found && fgets(buf, sizeof(buf), f)) {
+        if (sscanf(buf, "%63s %7s %lf %lf %lf %lf", base->image, base->result,
+                    &base->ms[0], &base->ms[1], &base->ms[2], &base->ms[3]) == 6
+                && !strcmp(base->image, image))
+            found = 0;
+    }
+    fclose(f);
+    return found;
+}
+
+/**
+ * Compare with the baseline.
+ * @return 1 if anything regressed
+ */
+static int compare(result_t const *r, result_t const *base, double threshold)
+{
+    int regressed = 0;
+    int m;
+
+    if (strcmp(r->result, base->result)) {
+        printf("  %s: result %s, baseline %s\n", r->image, r->result, base->result);
+        regressed = 1;
+    }
+    for (m = 0; m < MODES; m++) {
+        double change = base->ms[m] > 0 ? (r->ms[m] / base->ms[m] - 1) * 100 : 0;
+        int slower = change > threshold && r->ms[m] - base->ms[m] > MIN_REGRESSION_MS;
+
+        printf("  %-8s %10.3f ms, baseline %10.3f ms, %+6.1f%%%s\n", mode_names[m],
+                r->ms[m], base->ms[m], change, slower ? "  REGRESSED" : "");
+        regressed |= slower;
+    }
+    return regressed;
+}
+
+int main(int argc, char *argv[])
+{
+    char const *write_path = NULL;
+    char const *compare_path = NULL;
+    FILE *baseline = NULL;
+    double threshold = 25;
+    int runs = 20;
+    int failed = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "n:w:c:t:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 'w': write_path = optarg; break;
+            case 'c': compare_path = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            default: runs = 0; break;
+        }
+    }
+    if (optind >= argc || runs < 1 || (write_path && compare_path)) {
+        fprintf(stderr, "usage: %s [-n runs] [-w baseline | -c baseline [-t percent]] file.hex...\n",
+                argv[0]);
+        return 2;
+    }
+    if (write_path) {
+        if (!(baseline = fopen(write_path, "w"))) {
+            perror(write_path);
+            return 1;
+        }
+        fprintf(baseline, "# image result flash_ms verify_ms base64_ms binary_ms\n");
+    }
+
+    printf("%-40s %-8s %9s %7s %6s %10s %10s %10s %10s %10s\n",
+            "image", "result", "hex bytes", "lines", "pages", "flash ms", "verify ms",
+            "base64 ms", "binary ms", "MB/s");
+    for (i = optind; i < argc; i++) {
+        size_t len;
+        char *hex = read_file(argv[i], &len);
+        char const *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        result_t r;
+        uint16_t lines, pages;
+        addr_t end;
+        double flash, t;
+        int m;
+
+        if (!hex) {
+            perror(argv[i]);
+            failed = 1;
+            continue;
+        }
+        memset(&r, 0, sizeof(r));
+        snprintf(r.image, sizeof(r.image), "%s", name);
+
+        host_reset();
+        host_run(hex, len);
+        lines = stats.lines;
+        pages = stats.pages;
+        end = used_extent();
+
+        // the same hex pasted twice: flash, then verify
+        memcpy(hex + len, hex, len);
+        host_reset();
+        host_run(hex, 2 * len);
+        strcpy(r.result, output_count("OK!") == 2 ? "ok" : "error");
+
+        flash = time_run(hex, len, runs);
+        r.ms[0] = flash * 1e3;
+        t = time_run(hex, 2 * len, runs);
+        r.ms[1] = (t - flash) * 1e3;
+
+        // flash, then read it back
+        for (m = 2; m < MODES; m++) {
+            int n = sprintf(hex + len, "%c 0 %lX\r", m == 2 ? 'b' : 'B', (unsigned long) end);
+            t = time_run(hex, len + n, runs);
+            r.ms[m] = (t - flash) * 1e3;
+        }
+
+        printf("%-40s %-8s %9zu %7u %6u %10.3f %10.3f %10.3f %10.3f %10.1f\n",
+                argv[i], r.result, len, lines, pages, r.ms[0], r.ms[1], r.ms[2], r.ms[3],
+                len / flash / 1e6);
+        if (baseline) {
+            fprintf(baseline, "%s %s %.3f %.3f %.3f %.3f\n",
+                    r.image, r.result, r.ms[0], r.ms[1], r.ms[2], r.ms[3]);
+        }
+        if (compare_path) {
+            result_t base;
+            if (load_baseline(compare_path, r.image, &base)) {
+                printf("  %s: no baseline in %s\n", r.image, compare_path);
+                failed = 1;
+            }
+            else {
+                failed |= compare(&r, &base, threshold);
+            }
+        }
+        free(hex);
+    }
+    if (baseline)
+        fclose(baseline);
+    if (compare_path)
+        printf("%s\n", failed ? "FAILED: slower than the baseline" : "within the baseline");
+    return failed;
+}
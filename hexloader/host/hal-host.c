@@ -0,0 +1,260 @@
+/**
+ * Host implementation of the HAL.
+ * The flash and EEPROM are arrays, the serial input is a memory buffer
+ * and the output is collected in another one. bootloader() is run by
+ * #host_run until it reboots or consumes all the input.
+ *
+ * #host_serve runs it against a file descriptor (a pseudo terminal, see
+ * standin.c) instead, for as long as the other end stays open.
+ */
+#define _DEFAULT_SOURCE
+#include <poll.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+
+// Variables
+
+uint8_t sim_flash[FLASH_SIZE];              ///< simulated flash
+uint8_t sim_eeprom[E2END + 1];              ///< simulated EEPROM
+
+volatile uint8_t uart_error;
+volatile stats_t stats;
+volatile uint8_t trace_paused;
+
+trace_t trace_ring[TRACE_LEN];
+uint8_t trace_head;
+uint8_t trace_count;
+
+static jmp_buf host_exit;                   ///< where #host_run returns from
+static char const *input;                   ///< serial input
+static size_t input_len, input_pos;
+static char *output;                        ///< serial output
+static size_t output_len, output_size;
+static int serial_fd = -1;                  ///< serial stream for #host_serve, -1 for the memory buffers
+static uint32_t page_us;                    ///< simulated erase and write time, for #host_serve
+
+
+///////////////////////////////////////////////////////////////////////
+// Harness
+///////////////////////////////////////////////////////////////////////
+
+/**
+ * Erase the simulated flash and EEPROM, and clear the trace.
+ */
+void host_reset(void)
+{
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+    memset(sim_eeprom, 0xff, sizeof(sim_eeprom));
+    trace_head = trace_count = 0;
+}
+
+/**
+ * Run a bootloader session.
+ * @param in serial input
+ * @param len input length
+ * @return why the session ended, one of the HOST_EXIT_* values
+ */
+int host_run(char const *in, size_t len)
+{
+    int r;
+
+    input = in;
+    input_len = len;
+    input_pos = 0;
+    output_len = 0;
+
+    r = setjmp(host_exit);
+    if (r == 0)
+        bootloader();
+    return r - 1;
+}
+
+/**
+ * Run bootloader sessions against a serial stream.
+ * Reboots into the bootloader start a new session. Reboots into the app
+ * run a stand-in for test-reboot/test.c instead, which greets and goes
+ * back to the bootloader on 'b'.
+ * @param fd serial stream, read and written a byte at a time
+ * @param page_ms time an erase or a write takes, as on the chip (4.5 ms
+ *     max in the datasheet), 0 for none
+ * @return when the other end closes the stream
+ */
+void host_serve(int fd, double page_ms)
+{
+
+    serial_fd = fd;
+    page_us = page_ms * 1000;
+    for (;;) {
+        int r = setjmp(host_exit);
+        if (r == HOST_EXIT_INPUT + 1)
+            break;
+        if (r != HOST_EXIT_APP + 1) {
+            bootloader();
+        }
+        else {
+            uart_send_string(P("Hello world, press 'r' to reboot, 'b' for bootloader\r\n"));
+            while (uart_recv_byte() != 'b')
+                ;
+            uart_send_string(P("Rebooting to bootloader...\r\n"));
+            longjmp(host_exit, HOST_EXIT_BOOTLOADER + 1);
+        }
+    }
+    serial_fd = -1;
+}
+
+/**
+ * Output of the last session.
+ * @param len set to the output length
+ * @return the output, not null terminated
+ */
+char const *host_output(size_t *len)
+{
+    *len = output_len;
+    return output;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// HAL (see ../hal-avr.c for what every function does on the chip)
+///////////////////////////////////////////////////////////////////////
+
+void hal_init(void)
+{
+    memset((void *)&stats, 0, sizeof(stats));
+    uart_error = 0;
+}
+
+uint32_t ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (1000000 / US_PER_TICK) + ts.tv_nsec / (1000 * US_PER_TICK);
+}
+
+uint32_t millis(void)
+{
+    return ticks() / (1000 / US_PER_TICK);
+}
+
+uint32_t idle_millis(void)
+{
+    return 0;
+}
+
+void uart_send_byte(uint8_t c)
+{
+    if (serial_fd >= 0) {
+        if (write(serial_fd, &c, 1) != 1)
+            longjmp(host_exit, HOST_EXIT_INPUT + 1);
+        return;
+    }
+    if (output_len == output_size) {
+        output_size = output_size ? output_size * 2 : 4096;
+        output = realloc(output, output_size);
+        if (!output)
+            abort();
+    }
+    output[output_len++] = c;
+}
+
+void uart_flush(void)
+{
+}
+
+uint8_t uart_recv_byte(void)
+{
+    uint8_t c;
+
+    if (serial_fd >= 0) {
+        if (read(serial_fd, &c, 1) != 1)
+            longjmp(host_exit, HOST_EXIT_INPUT + 1);
+        return c;
+    }
+    if (input_pos == input_len)
+        longjmp(host_exit, HOST_EXIT_INPUT + 1);
+    return input[input_pos++];
+}
+
+// The memory input never times out: the session ends when it runs out instead
+uint8_t uart_wait(uint32_t timeout)
+{
+    if (serial_fd >= 0) {
+        struct pollfd pfd = { serial_fd, POLLIN, 0 };
+        return poll(&pfd, 1, timeout) != 0;
+    }
+    return 1;
+}
+
+int8_t uart_available(void)
+{
+    if (serial_fd >= 0)
+        return uart_wait(0);
+    return input_pos != input_len;
+}
+
+void flash_erase_page(addr_t address)
+{
+    if (page_us)
+        usleep(page_us);
+    memset(sim_flash + address, 0xff, PAGE_SIZE);
+}
+
+void flash_write_page(addr_t address, uint8_t const *data)
+{
+    int i;
+
+    if (page_us)
+        usleep(page_us);
+    // like the real thing, writing can only clear bits
+    for (i = 0; i < PAGE_SIZE; i++)
+        sim_flash[address + i] &= data[i];
+}
+
+void flash_rww_enable(void)
+{
+}
+
+void eeprom_read(void *dst, uint16_t address, uint8_t n)
+{
+    memcpy(dst, sim_eeprom + address, n);
+}
+
+void eeprom_write(void const *src, uint16_t address, uint8_t n)
+{
+    memcpy(sim_eeprom + address, src, n);
+}
+
+void trace(uint8_t type)
+{
+    trace_t *e = &trace_ring[trace_head];
+    uint32_t t = ticks();
+
+    if (trace_paused)
+        return;
+    e->time = t;
+    e->epoch = t >> 16;
+    e->type = type;
+    e->rx_level = 0;
+    trace_head = (trace_head + 1) % TRACE_LEN;
+    if (trace_count < TRACE_LEN)
+        trace_count++;
+}
+
+uint16_t stack_free(void)
+{
+    return 0;
+}
+
+uint16_t stack_size(void)
+{
+    return 0;
+}
+
+void __attribute__((noreturn)) reboot(uint8_t to_app)
+{
+    longjmp(host_exit, (to_app ? HOST_EXIT_APP : HOST_EXIT_BOOTLOADER) + 1);
+}
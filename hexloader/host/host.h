@@ -0,0 +1,26 @@
+#pragma once
+
+/**
+ * Host harness for the bootloader core.
+ * Runs bootloader() against the simulated flash and EEPROM in
+ * hal-host.c, feeding it an in-memory serial stream.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../hal.h"
+
+#define HOST_EXIT_INPUT             0       ///< all the input was consumed
+#define HOST_EXIT_BOOTLOADER        1       ///< the core rebooted into the bootloader
+#define HOST_EXIT_APP               2       ///< the core rebooted into the app
+
+extern uint8_t sim_eeprom[E2END + 1];       ///< simulated EEPROM
+
+void host_reset(void);
+int host_run(char const *input, size_t len);
+void host_serve(int fd, double page_ms);
+char const *host_output(size_t *len);
+
+// From the core, to size flash readouts and greet from the app stand-in
+addr_t used_extent(void);
+void uart_send_string(char const s[]);
@@ -0,0 +1,131 @@
+/**
+ * Bootloader stand-in on a pseudo terminal.
+ *
+ * Runs the bootloader core against the simulated flash, with its serial
+ * port on a new pseudo terminal, so that host tools and libraries can be
+ * tested against the real protocol without a board:
+ *
+ *     standin [-p ms] [-i file.hex] [-L link]
+ *
+ *   -p  time a page erase or write takes, 0 (the default) for none; the
+ *       chip takes 3.6 ms for each
+ *   -i  flash a hex file before starting, as if it had been pasted
+ *   -L  symlink to the pseudo terminal
+ *
+ * It starts at the bootloader prompt. Booting the app runs a stand-in
+ * for test-reboot, which goes back to the bootloader on 'b'. The pseudo
+ * terminal never paces or drops bytes, so rx buffer overflows don't
+ * happen here (see tools/linkemu for that).
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include "host.h"
+
+static char const *symlink_path;
+
+static void on_signal(int sig)
+{
+    if (symlink_path)
+        unlink(symlink_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * Flash a hex file into the simulated flash.
+ * @return 0 if the bootloader took it
+ */
+static int preload(char const *path)
+{
+    FILE *f = fopen(path, "rb");
+    char *hex;
+    long n;
+    int r = -1;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    rewind(f);
+    if ((hex = malloc(n)) && fread(hex, 1, n, f) == (size_t) n) {
+        size_t len;
+        char const *out;
+
+        host_run(hex, n);
+        out = host_output(&len);
+        r = memmem(out, len, " OK! (", 6) ? 0 : -1;
+        if (r)
+            fprintf(stderr, "standin: %s didn't flash:\n%.*s\n", path, (int) len, out);
+    }
+    free(hex);
+    fclose(f);
+    return r;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: standin [-p ms] [-i file.hex] [-L link]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char const *image = NULL;
+    double page_ms = 0;
+    struct termios t;
+    int master, slave;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:i:L:")) != -1) {
+        switch (opt) {
+            case 'p': page_ms = atof(optarg); break;
+            case 'i': image = optarg; break;
+            case 'L': symlink_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    host_reset();
+    if (image && preload(image))
+        return 1;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master)) {
+        perror("pty");
+        return 1;
+    }
+    // keep the slave open so the master doesn't hang up between clients
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0 || tcgetattr(slave, &t)) {
+        perror(ptsname(master));
+        return 1;
+    }
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+    if (symlink_path) {
+        unlink(symlink_path);
+        if (symlink(ptsname(master), symlink_path)) {
+            perror(symlink_path);
+            return 1;
+        }
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    fprintf(stderr, "standin: %s\n", symlink_path ? symlink_path : ptsname(master));
+
+    host_serve(master, page_ms);
+    if (symlink_path)
+        unlink(symlink_path);
+    return 0;
+}
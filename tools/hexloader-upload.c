@@ -0,0 +1,460 @@
+/**
+ * Paced hex uploader.
+ *
+ * Sends a hex file to the bootloader the way a paste would, but leaves
+ * the line idle after every flash page for as long as the AVR takes to
+ * erase and write it, so that the rx buffer doesn't overflow at high
+ * baud rates. Works with the stock bootloader, built for the same baud
+ * rate (make BAUD_RATE=...):
+ *
+ *     hexloader-upload [-a 328p|2560] [-b baud] [-p ms] [-n] [-r] device file.hex
+ *
+ *   -a  target arch, for the page size and the flash limit (default 328p)
+ *   -b  baud rate (default 115200)
+ *   -p  idle time after each page in ms (default 9, the erase plus write
+ *       time in the datasheet), 0 for no pacing
+ *   -n  don't verify, boot the app right after flashing
+ *   -r  resuming an upload, so the first address needn't be 0
+ *
+ * The file is checked before anything is sent, with the same rules as
+ * the bootloader: checksums, at most 16 bytes per record, increasing
+ * addresses from 0 and below the bootloader. The device must be at the
+ * bootloader prompt. Its progress ("Flashed N") is shown as it comes and
+ * the throughput is worked out from the time it reports ("OK! (N ms").
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LINE_LEN    64              ///< as in the bootloader, including the terminating NUL
+#define MAX_RECORD      16              ///< data bytes per record the bootloader takes
+#define PROMPT_TIMEOUT  2000            ///< ms to wait for the prompt
+#define RESULT_TIMEOUT  5000            ///< ms to wait for the result after the last line
+#define ESC             0x1b
+
+#define PROMPT          ">: "
+#define DONE            " OK! ("
+#define FAILED          "Rebooting into bootloader"
+
+/** Arch parameters, from arch.h. */
+typedef struct {
+    char const *name;
+    uint32_t page_size;
+    uint32_t nrww_start;
+} arch_t;
+
+static arch_t const archs[] = {
+    { "328p", 0x80, 0x7000 },
+    { "2560", 0x100, 0x3e000 },
+};
+
+/** A record to send. */
+typedef struct {
+    char text[MAX_LINE_LEN];
+    uint8_t new_page;                   ///< the device writes a page when it gets this record
+} record_t;
+
+/** Hex file, checked and ready to send. */
+typedef struct {
+    record_t *records;
+    int count;
+    uint32_t data_bytes;
+    uint32_t wire_bytes;
+    uint32_t pages;                     ///< page writes, including the last one
+} image_t;
+
+/** Device output. */
+typedef struct {
+    int fd;
+    char out[8192];                     ///< since the last #clear_output, NUL terminated
+    size_t len;
+    uint32_t progress;                  ///< last "Flashed N" or "Verified N"
+} device_t;
+
+static uint8_t hex_value(char const *s, int n, int *ok)
+{
+    uint8_t v = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else
+            *ok = 0;
+    }
+    return v;
+}
+
+/**
+ * Load a hex file and check it like the bootloader would, noting which
+ * records make the device write a page.
+ * @return 0 if the file is fine, otherwise an error has been printed
+ */
+static int load_image(char const *path, arch_t const *arch, int resume, image_t *image)
+{
+    FILE *f = fopen(path, "r");
+    char buf[256];
+    uint32_t extension = 0;
+    uint32_t last_address = UINT32_MAX;
+    int lineno = 0;
+    int eof = 0;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    memset(image, 0, sizeof(*image));
+    while (fgets(buf, sizeof(buf), f)) {
+        record_t *r;
+        uint32_t address;
+        uint8_t count, type, sum = 0;
+        size_t len = strcspn(buf, "\r\n");
+        int ok = 1;
+        size_t i;
+
+        lineno++;
+        buf[len] = '\0';
+        if (!len)
+            continue;
+        if (eof) {
+            fprintf(stderr, "%s:%d: data after the end of file record\n", path, lineno);
+            goto error;
+        }
+        if (buf[0] != ':' || len < 11 || len % 2 == 0 || len > MAX_LINE_LEN - 1) {
+            fprintf(stderr, "%s:%d: not an ihex record\n", path, lineno);
+            goto error;
+        }
+        for (i = 1; i < len; i += 2)
+            sum += hex_value(buf + i, 2, &ok);
+        count = hex_value(buf + 1, 2, &ok);
+        address = hex_value(buf + 3, 2, &ok) << 8 | hex_value(buf + 5, 2, &ok);
+        type = hex_value(buf + 7, 2, &ok);
+        if (!ok || len != 11 + 2 * (size_t) count) {
+            fprintf(stderr, "%s:%d: not an ihex record\n", path, lineno);
+            goto error;
+        }
+        if (sum) {
+            fprintf(stderr, "%s:%d: checksum error\n", path, lineno);
+            goto error;
+        }
+        if (count > MAX_RECORD) {
+            fprintf(stderr, "%s:%d: records >%d bytes not supported\n", path, lineno, MAX_RECORD);
+            goto error;
+        }
+
+        if (!(image->count % 256)) {
+            image->records = realloc(image->records, (image->count + 256) * sizeof(record_t));
+            if (!image->records) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        r = &image->records[image->count++];
+        strcpy(r->text, buf);
+        r->new_page = 0;
+        image->wire_bytes += len + 1;
+
+        if (type == 0x04) {
+            extension = (uint32_t) (hex_value(buf + 9, 2, &ok) << 8 | hex_value(buf + 11, 2, &ok)) << 16;
+        }
+        else if (type == 0x02) {
+            extension = (uint32_t) (hex_value(buf + 9, 2, &ok) << 8 | hex_value(buf + 11, 2, &ok)) << 4;
+        }
+        else if (type == 0x01) {
+            eof = 1;
+            image->pages++;
+        }
+        else if (type == 0x00 && count) {
+            address += extension;
+            if (address >= arch->nrww_start) {
+                fprintf(stderr, "%s:%d: program too big (%05x is the bootloader's)\n", path, lineno, address);
+                goto error;
+            }
+            if (last_address == UINT32_MAX && address != 0 && !resume) {
+                fprintf(stderr, "%s:%d: first address must be 0\n", path, lineno);
+                goto error;
+            }
+            if (last_address != UINT32_MAX && address < last_address) {
+                fprintf(stderr, "%s:%d: addresses must be increasing\n", path, lineno);
+                goto error;
+            }
+            if (last_address != UINT32_MAX
+                    && (address + count - 1) / arch->page_size != last_address / arch->page_size) {
+                r->new_page = 1;
+                image->pages++;
+            }
+            last_address = address + count - 1;
+            image->data_bytes += count;
+        }
+    }
+    fclose(f);
+    if (!eof) {
+        fprintf(stderr, "%s: no end of file record\n", path);
+        return -1;
+    }
+    return 0;
+
+error:
+    fclose(f);
+    return -1;
+}
+
+/**
+ * Monotonic time in milliseconds.
+ */
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static speed_t baud_constant(uint32_t baud)
+{
+    static struct { uint32_t baud; speed_t speed; } const rates[] = {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+        { 115200, B115200 }, { 230400, B230400 },
+#ifdef B460800
+        { 460800, B460800 }, { 500000, B500000 }, { 921600, B921600 }, { 1000000, B1000000 },
+        { 2000000, B2000000 },
+#endif
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+        if (rates[i].baud == baud)
+            return rates[i].speed;
+    return 0;
+}
+
+/**
+ * Open the serial port: raw 8N1, no flow control.
+ */
+static int open_device(char const *path, uint32_t baud)
+{
+    struct termios t;
+    speed_t speed = baud_constant(baud);
+    int fd;
+
+    if (!speed) {
+        fprintf(stderr, "hexloader-upload: unsupported baud rate %u\n", baud);
+        return -1;
+    }
+    fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0 || tcgetattr(fd, &t)) {
+        perror(path);
+        return -1;
+    }
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cflag &= ~(CSTOPB | CRTSCTS);
+    cfsetispeed(&t, speed);
+    cfsetospeed(&t, speed);
+    if (tcsetattr(fd, TCSANOW, &t)) {
+        perror(path);
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+static void clear_output(device_t *d)
+{
+    d->len = 0;
+    d->out[0] = '\0';
+}
+
+/**
+ * Read the device output for a while, showing the progress.
+ * @param d device
+ * @param ms time to wait for output, 0 to only take what's there
+ */
+static void read_output(device_t *d, double ms)
+{
+    double deadline = now_ms() + ms;
+
+    for (;;) {
+        struct pollfd pfd = { d->fd, POLLIN, 0 };
+        double left = deadline - now_ms();
+        char buf[256];
+        ssize_t n;
+        char *p;
+
+        if (poll(&pfd, 1, left > 0 ? (int) (left + 0.5) : 0) <= 0)
+            return;
+        if ((n = read(d->fd, buf, sizeof(buf))) <= 0)
+            return;
+        if (d->len + n >= sizeof(d->out)) {
+            // keep the tail, which has any marker being waited for
+            size_t keep = sizeof(d->out) / 2;
+            memmove(d->out, d->out + d->len - keep, keep);
+            d->len = keep;
+        }
+        memcpy(d->out + d->len, buf, n);
+        d->len += n;
+        d->out[d->len] = '\0';
+
+        p = strrchr(d->out, '\r');
+        if (p && (!strncmp(p, "\rFlashed ", 9) || !strncmp(p, "\rVerified ", 10))) {
+            uint32_t progress = strtoul(strchr(p, ' ') + 1, NULL, 10);
+            if (progress != d->progress) {
+                d->progress = progress;
+                fprintf(stderr, "%s", p);
+            }
+        }
+    }
+}
+
+/**
+ * Wait for some output from the device.
+ * @return pointer to it in the output, NULL on timeout or failure
+ */
+static char *wait_for(device_t *d, char const *text, double ms)
+{
+    double deadline = now_ms() + ms;
+    char *p;
+
+    while (!(p = strstr(d->out, text)) && !strstr(d->out, FAILED) && now_ms() < deadline)
+        read_output(d, 10);
+    return p;
+}
+
+/**
+ * Send the image, once for flashing or verifying.
+ * @param d device
+ * @param image checked hex file
+ * @param pace ms to leave the line idle after a page, 0 for none
+ * @return ms the device took according to its "OK! (" report, -1 on failure
+ */
+static long send_image(device_t *d, image_t const *image, double pace)
+{
+    char *p;
+    int i;
+
+    clear_output(d);
+    d->progress = 0;
+    for (i = 0; i < image->count; i++) {
+        record_t const *r = &image->records[i];
+        size_t len = strlen(r->text);
+
+        if (write(d->fd, r->text, len) != (ssize_t) len || write(d->fd, "\n", 1) != 1) {
+            perror("write");
+            return -1;
+        }
+        if (r->new_page && pace > 0) {
+            // the page is written once this record gets there
+            tcdrain(d->fd);
+            read_output(d, pace);
+        }
+        else {
+            read_output(d, 0);
+        }
+        if (strstr(d->out, FAILED))
+            break;
+    }
+    if (!(p = wait_for(d, DONE, RESULT_TIMEOUT)))
+        return -1;
+    fprintf(stderr, "\n");
+    return strtol(p + strlen(DONE), NULL, 10);
+}
+
+/**
+ * Print the device output after a failure, to show its error message.
+ */
+static int failed(device_t *d, char const *what)
+{
+    read_output(d, 200);
+    fprintf(stderr, "\nhexloader-upload: %s failed, the device said:\n%s\n", what, d->out);
+    return 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: hexloader-upload [-a 328p|2560] [-b baud] [-p ms] [-n] [-r] device file.hex\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static device_t d;
+    arch_t const *arch = &archs[0];
+    image_t image;
+    uint32_t baud = 115200;
+    double pace = 9;
+    int verify = 1;
+    int resume = 0;
+    double t0;
+    long flash_ms, verify_ms = 0;
+    int opt;
+    unsigned i;
+
+    while ((opt = getopt(argc, argv, "a:b:p:nr")) != -1) {
+        switch (opt) {
+            case 'a':
+                arch = NULL;
+                for (i = 0; i < sizeof(archs) / sizeof(archs[0]); i++)
+                    if (!strcmp(optarg, archs[i].name))
+                        arch = &archs[i];
+                break;
+            case 'b': baud = strtoul(optarg, NULL, 10); break;
+            case 'p': pace = atof(optarg); break;
+            case 'n': verify = 0; break;
+            case 'r': resume = 1; break;
+            default: usage();
+        }
+    }
+    if (!arch || argc - optind != 2)
+        usage();
+
+    if (load_image(argv[optind + 1], arch, resume, &image))
+        return 1;
+    if ((d.fd = open_device(argv[optind], baud)) < 0)
+        return 1;
+
+    // an escape gets a fresh prompt
+    if (write(d.fd, "\x1b", 1) != 1 || !wait_for(&d, PROMPT, PROMPT_TIMEOUT)) {
+        fprintf(stderr, "hexloader-upload: no prompt on %s, is the bootloader running at %u baud?\n",
+                argv[optind], baud);
+        return 1;
+    }
+
+    t0 = now_ms();
+    if ((flash_ms = send_image(&d, &image, pace)) < 0)
+        return failed(&d, "flashing");
+    printf("Flashed %u bytes in %u pages: %ld ms on the device, %.0f ms here, %.1f KB/s\n",
+            image.data_bytes, image.pages, flash_ms, now_ms() - t0,
+            flash_ms ? image.data_bytes / (double) flash_ms : 0);
+
+    if (verify) {
+        if (!wait_for(&d, PROMPT, PROMPT_TIMEOUT))
+            return failed(&d, "flashing");
+        t0 = now_ms();
+        if ((verify_ms = send_image(&d, &image, 0)) < 0)
+            return failed(&d, "verifying");
+        printf("Verified %u bytes: %ld ms on the device, %.0f ms here, %.1f KB/s\n",
+                image.data_bytes, verify_ms, now_ms() - t0,
+                verify_ms ? image.data_bytes / (double) verify_ms : 0);
+    }
+    else {
+        if (!wait_for(&d, PROMPT, PROMPT_TIMEOUT) || write(d.fd, "q\n", 2) != 2)
+            return failed(&d, "booting the app");
+    }
+    printf("%u bytes on the wire per pass at %u baud, line rate %.1f KB/s\n",
+            image.wire_bytes, baud, baud / 10 / 1000.0 * image.data_bytes / image.wire_bytes);
+    close(d.fd);
+    return 0;
+}
@@ -0,0 +1,463 @@
+/**
+ * Hex image optimizer.
+ *
+ * Rewrites an Intel hex file (or the flash part of an ELF) into the
+ * cheapest stream the bootloader takes for the same flash contents:
+ *
+ *     hexopt [-a 328p|2560] [-b baud] [-p ms] [-s] [-o out.hex] in.hex|in.elf
+ *
+ *   -a  target arch, for the page size and the flash limit (default 328p)
+ *   -b  baud rate for the upload time estimate (default 115200)
+ *   -p  page erase plus write time in ms for the estimate (default 9)
+ *   -s  sparse: leave out pages which are all 0xff, see below
+ *   -o  output file (default stdout)
+ *
+ * Records are merged and sorted by address, split at page boundaries and
+ * packed into records of at most 16 bytes, the most the bootloader
+ * takes. Bytes the bootloader would leave as 0xff anyway (it starts
+ * every page erased) are not sent: runs of 0xff are cut out of the
+ * records where that saves wire bytes, and 02/04 records are only sent
+ * when the upper address bits change. 03/05 start address records are
+ * dropped, the bootloader ignores them.
+ *
+ * The bootloader only erases a page when some data falls into it, so a
+ * page of the input which is all 0xff still gets a 1 byte record, unless
+ * -s says the flash there is already known to be erased.
+ *
+ * The savings and an estimate of the upload time at the given baud rate
+ * are printed on stderr.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_RECORD      16              ///< data bytes per record the bootloader takes
+#define RECORD_COST     12              ///< wire bytes of a record besides its data: ":", count, address, type, checksum and "\n"
+#define MAX_IMAGE       (256 * 1024L)
+#define ELF_FLASH_END   0x800000        ///< avr-gcc puts SRAM and EEPROM above this in ELF addresses
+
+/** Arch parameters, from arch.h. */
+typedef struct {
+    char const *name;
+    uint32_t page_size;
+    uint32_t nrww_start;
+} arch_t;
+
+static arch_t const archs[] = {
+    { "328p", 0x80, 0x7000 },
+    { "2560", 0x100, 0x3e000 },
+};
+
+/** Flash contents and what it took to send them. */
+typedef struct {
+    uint8_t data[MAX_IMAGE];
+    uint8_t present[MAX_IMAGE];         ///< 1 where the input has a byte
+    uint32_t low;                       ///< lowest address in the input
+    uint32_t records;                   ///< records in the input
+    uint32_t wire_bytes;                ///< size of the input as a hex stream
+} image_t;
+
+/** Output hex stream. */
+typedef struct {
+    FILE *f;
+    uint32_t extension;                 ///< current 04 address extension
+    uint32_t records;
+    uint32_t wire_bytes;
+    uint32_t data_bytes;
+    uint32_t pages;                     ///< pages the bootloader writes
+} output_t;
+
+static uint8_t hex_value(char const *s, int n, int *ok)
+{
+    uint8_t v = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else
+            *ok = 0;
+    }
+    return v;
+}
+
+/**
+ * Put a byte in the image.
+ * @return 0 if fine, -1 if it's out of the app space or clashes with a
+ *     different byte at the same address
+ */
+static int put_byte(image_t *image, arch_t const *arch, char const *where, uint32_t address, uint8_t b)
+{
+    if (address >= arch->nrww_start) {
+        fprintf(stderr, "%s: program too big (%05x is the bootloader's)\n", where, address);
+        return -1;
+    }
+    if (image->present[address] && image->data[address] != b) {
+        fprintf(stderr, "%s: %05x given twice with different values\n", where, address);
+        return -1;
+    }
+    image->data[address] = b;
+    image->present[address] = 1;
+    if (address < image->low)
+        image->low = address;
+    return 0;
+}
+
+/**
+ * Load an ihex file, with records of any length and in any order.
+ * @return 0 if fine, otherwise an error has been printed
+ */
+static int load_hex(FILE *f, char const *path, arch_t const *arch, image_t *image)
+{
+    char buf[600];
+    char where[300];
+    uint32_t extension = 0;
+    int lineno = 0;
+
+    while (fgets(buf, sizeof(buf), f)) {
+        uint32_t address;
+        uint8_t count, type, sum = 0;
+        size_t len = strcspn(buf, "\r\n");
+        int ok = 1;
+        size_t i;
+
+        lineno++;
+        snprintf(where, sizeof(where), "%s:%d", path, lineno);
+        buf[len] = '\0';
+        if (!len)
+            continue;
+        if (buf[0] != ':' || len < 11 || len % 2 == 0) {
+            fprintf(stderr, "%s: not an ihex record\n", where);
+            return -1;
+        }
+        for (i = 1; i < len; i += 2)
+            sum += hex_value(buf + i, 2, &ok);
+        count = hex_value(buf + 1, 2, &ok);
+        address = hex_value(buf + 3, 2, &ok) << 8 | hex_value(buf + 5, 2, &ok);
+        type = hex_value(buf + 7, 2, &ok);
+        if (!ok || len != 11 + 2 * (size_t) count) {
+            fprintf(stderr, "%s: not an ihex record\n", where);
+            return -1;
+        }
+        if (sum) {
+            fprintf(stderr, "%s: checksum error\n", where);
+            return -1;
+        }
+        image->records++;
+        image->wire_bytes += len + 1;
+
+        if (type == 0x04) {
+            extension = (uint32_t) (hex_value(buf + 9, 2, &ok) << 8 | hex_value(buf + 11, 2, &ok)) << 16;
+        }
+        else if (type == 0x02) {
+            extension = (uint32_t) (hex_value(buf + 9, 2, &ok) << 8 | hex_value(buf + 11, 2, &ok)) << 4;
+        }
+        else if (type == 0x01) {
+            return 0;
+        }
+        else if (type == 0x00) {
+            for (i = 0; i < count; i++)
+                if (put_byte(image, arch, where, address + extension + i, hex_value(buf + 9 + 2 * i, 2, &ok)))
+                    return -1;
+        }
+    }
+    fprintf(stderr, "%s: no end of file record\n", path);
+    return -1;
+}
+
+static uint32_t le16(uint8_t const *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(uint8_t const *p)
+{
+    return le16(p) | le16(p + 2) << 16;
+}
+
+/**
+ * Load the flash part of an avr-gcc ELF file: the loadable segments at
+ * their physical addresses, which for .data are the initializers in
+ * flash. The wire size of the input is worked out as objcopy -O ihex
+ * would write it, 16 byte records from the start of each segment.
+ * @return 0 if fine, otherwise an error has been printed
+ */
+static int load_elf(FILE *f, char const *path, arch_t const *arch, image_t *image)
+{
+    uint8_t eh[52], ph[32];
+    uint32_t phoff, phentsize, phnum, i;
+    uint32_t extension = 0;
+
+    if (fread(eh, sizeof(eh), 1, f) != 1 || eh[4] != 1 || eh[5] != 1) {
+        fprintf(stderr, "%s: not a 32 bit little endian ELF file\n", path);
+        return -1;
+    }
+    phoff = le32(eh + 28);
+    phentsize = le16(eh + 42);
+    phnum = le16(eh + 44);
+
+    for (i = 0; i < phnum; i++) {
+        uint32_t offset, paddr, filesz, j;
+
+        if (fseek(f, phoff + i * phentsize, SEEK_SET) || fread(ph, sizeof(ph), 1, f) != 1) {
+            fprintf(stderr, "%s: truncated program header\n", path);
+            return -1;
+        }
+        offset = le32(ph + 4);
+        paddr = le32(ph + 12);
+        filesz = le32(ph + 16);
+        if (le32(ph) != 1 || !filesz || paddr >= ELF_FLASH_END)     // PT_LOAD in flash only
+            continue;
+
+        if (fseek(f, offset, SEEK_SET)) {
+            perror(path);
+            return -1;
+        }
+        for (j = 0; j < filesz; j++) {
+            int c = fgetc(f);
+            if (c == EOF) {
+                fprintf(stderr, "%s: truncated segment\n", path);
+                return -1;
+            }
+            if (put_byte(image, arch, path, paddr + j, c))
+                return -1;
+        }
+        for (j = 0; j < filesz; j += MAX_RECORD) {
+            uint32_t n = filesz - j < MAX_RECORD ? filesz - j : MAX_RECORD;
+            if ((paddr + j) >> 16 != extension >> 16) {
+                extension = (paddr + j) & 0xffff0000;
+                image->records++;
+                image->wire_bytes += RECORD_COST + 4;
+            }
+            image->records++;
+            image->wire_bytes += RECORD_COST + 2 * n;
+        }
+    }
+    image->records++;
+    image->wire_bytes += RECORD_COST;   // end of file
+    return 0;
+}
+
+/**
+ * Write a record.
+ */
+static void record(output_t *out, uint8_t type, uint16_t address, uint8_t const *data, uint8_t n)
+{
+    uint8_t sum = n + (address >> 8) + address + type;
+    int i;
+
+    fprintf(out->f, ":%02X%04X%02X", n, address, type);
+    for (i = 0; i < n; i++) {
+        fprintf(out->f, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(out->f, "%02X\n", (uint8_t) -sum);
+    out->records++;
+    out->wire_bytes += RECORD_COST + 2 * n;
+}
+
+/**
+ * Write a data record, preceded by a 04 record if it is in another
+ * 64 KB block than the last one.
+ */
+static void data_record(output_t *out, uint32_t address, uint8_t const *data, uint8_t n)
+{
+    if ((address & 0xffff0000) != out->extension) {
+        uint8_t upper[2] = { address >> 24, address >> 16 };
+        out->extension = address & 0xffff0000;
+        record(out, 0x04, 0, upper, 2);
+    }
+    record(out, 0x00, address, data, n);
+    out->data_bytes += n;
+}
+
+/**
+ * Write a page with the fewest wire bytes.
+ * Every byte in #need must be in a record, the rest may be left out as
+ * the bootloader fills it with 0xff. Records don't leave the page (which
+ * is 64 KB aligned as well), so the cheapest cover is found by dynamic
+ * programming over the page: cost[i] is the least it takes to send the
+ * needed bytes from i to the end of the page.
+ * @param out output
+ * @param address page address
+ * @param data page contents, 0xff where the input has nothing
+ * @param need 1 for the bytes that must be sent
+ * @param size page size
+ */
+static void write_page(output_t *out, uint32_t address, uint8_t const *data, uint8_t const *need, uint32_t size)
+{
+    uint32_t cost[size + 1];
+    uint8_t len[size + 1];              ///< record length starting at i in the best cover, 0 to skip byte i
+    uint32_t i, n;
+
+    cost[size] = 0;
+    for (i = size; i-- > 0;) {
+        cost[i] = UINT32_MAX;
+        if (!need[i]) {
+            cost[i] = cost[i + 1];
+            len[i] = 0;
+        }
+        for (n = 1; n <= MAX_RECORD && i + n <= size; n++) {
+            uint32_t c = RECORD_COST + 2 * n + cost[i + n];
+            if (c < cost[i]) {
+                cost[i] = c;
+                len[i] = n;
+            }
+        }
+    }
+    for (i = 0; i < size;) {
+        if (!len[i]) {
+            i++;
+            continue;
+        }
+        data_record(out, address + i, data + i, len[i]);
+        i += len[i];
+    }
+    out->pages++;
+}
+
+/**
+ * Write the image, page by page.
+ * @param out output
+ * @param image loaded input
+ * @param arch target arch
+ * @param sparse leave out pages which are all 0xff
+ */
+static void write_image(output_t *out, image_t const *image, arch_t const *arch, int sparse)
+{
+    uint8_t need[arch->page_size];
+    uint32_t address, i;
+
+    for (address = 0; address < arch->nrww_start; address += arch->page_size) {
+        uint8_t const *data = image->data + address;
+        int in_input = 0, any = 0;
+
+        for (i = 0; i < arch->page_size; i++) {
+            in_input |= image->present[address + i];
+            need[i] = image->present[address + i] && data[i] != 0xff;
+            any |= need[i];
+        }
+        if (!in_input || (!any && sparse))
+            continue;
+        if (!any)
+            need[0] = 1;                // one byte gets the page erased
+        if (address + arch->page_size > image->low && address <= image->low)
+            need[image->low - address] = 1;     // keeps the first address as in the input (0 for the bootloader)
+        write_page(out, address, data, need, arch->page_size);
+    }
+    record(out, 0x01, 0, NULL, 0);
+}
+
+/**
+ * Estimated time to flash a stream.
+ * Pages are erased and written while the next one comes in, so the
+ * slower of the line and the page programming sets the pace, plus the
+ * last page which is written after the end of the file.
+ */
+static double flash_ms(uint32_t wire_bytes, uint32_t pages, uint32_t baud, double page_ms)
+{
+    double line = wire_bytes * 10 * 1000.0 / baud;
+    double programming = pages * page_ms;
+
+    return (line > programming ? line : programming) + page_ms;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: hexopt [-a 328p|2560] [-b baud] [-p ms] [-s] [-o out.hex] in.hex|in.elf\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static image_t image;
+    output_t out = { stdout, 0, 0, 0, 0, 0 };
+    arch_t const *arch = &archs[0];
+    char const *path;
+    uint32_t baud = 115200;
+    uint32_t in_pages = 0, in_data = 0;
+    double page_ms = 9;
+    int sparse = 0;
+    char magic[4];
+    FILE *f;
+    int opt, err;
+    uint32_t i;
+
+    while ((opt = getopt(argc, argv, "a:b:p:so:")) != -1) {
+        switch (opt) {
+            case 'a':
+                arch = NULL;
+                for (i = 0; i < sizeof(archs) / sizeof(archs[0]); i++)
+                    if (!strcmp(optarg, archs[i].name))
+                        arch = &archs[i];
+                break;
+            case 'b': baud = strtoul(optarg, NULL, 10); break;
+            case 'p': page_ms = atof(optarg); break;
+            case 's': sparse = 1; break;
+            case 'o':
+                if (!(out.f = fopen(optarg, "w"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default: usage();
+        }
+    }
+    if (!arch || !baud || argc - optind != 1)
+        usage();
+
+    path = argv[optind];
+    if (!(f = fopen(path, "rb"))) {
+        perror(path);
+        return 1;
+    }
+    memset(image.data, 0xff, sizeof(image.data));
+    image.low = UINT32_MAX;
+    if (fread(magic, 4, 1, f) == 1 && !memcmp(magic, "\177ELF", 4)) {
+        rewind(f);
+        err = load_elf(f, path, arch, &image);
+    }
+    else {
+        rewind(f);
+        err = load_hex(f, path, arch, &image);
+    }
+    fclose(f);
+    if (err)
+        return 1;
+    if (image.low == UINT32_MAX) {
+        fprintf(stderr, "%s: no data\n", path);
+        return 1;
+    }
+
+    write_image(&out, &image, arch, sparse);
+    if (out.f != stdout)
+        fclose(out.f);
+
+    for (i = 0; i < arch->nrww_start; i++) {
+        in_data += image.present[i];
+        if (i % arch->page_size == 0) {
+            uint32_t j;
+            for (j = 0; j < arch->page_size && !image.present[i + j]; j++)
+                ;
+            in_pages += j < arch->page_size;
+        }
+    }
+    fprintf(stderr, "in:  %u records, %u data bytes, %u bytes on the wire\n",
+            image.records, in_data, image.wire_bytes);
+    fprintf(stderr, "out: %u records, %u data bytes, %u bytes on the wire (%.1f%% less)\n",
+            out.records, out.data_bytes, out.wire_bytes,
+            100.0 - 100.0 * out.wire_bytes / image.wire_bytes);
+    fprintf(stderr, "at %u baud: flash %.0f -> %.0f ms, verify %.0f -> %.0f ms, %u -> %u pages\n", baud,
+            flash_ms(image.wire_bytes, in_pages, baud, page_ms), flash_ms(out.wire_bytes, out.pages, baud, page_ms),
+            image.wire_bytes * 10 * 1000.0 / baud, out.wire_bytes * 10 * 1000.0 / baud,
+            in_pages, out.pages);
+    return 0;
+}
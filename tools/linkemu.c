@@ -0,0 +1,320 @@
+/**
+ * Serial link emulator.
+ *
+ * Sits between a terminal or uploader and the device, and makes the link
+ * behave like a Bluetooth serial module (eg. HC-06) or any other lossy,
+ * laggy link. It opens a pseudo terminal for the host side and forwards
+ * everything to and from the device side, which is any tty: a serial
+ * adapter, simavr's uart_pty or another pseudo terminal:
+ *
+ *     linkemu [-b baud] [-d ms] [-j ms] [-B bytes:ms] [-l rate] [-c rate]
+ *             [-s seed] [-L link] device
+ *
+ *   -b  pace the bytes at this baud rate (8N1), default no pacing
+ *   -d  one way latency in ms
+ *   -j  random jitter added to the latency, 0 to this many ms
+ *   -B  after every burst of this many bytes, stay silent for this many ms
+ *   -l  probability of losing a byte (0..1)
+ *   -c  probability of flipping a bit in a byte (0..1)
+ *   -s  random seed, for repeatable runs
+ *   -L  symlink to the host side pseudo terminal
+ *
+ * The impairments apply to both directions. Bytes never get reordered:
+ * jitter only ever delays a byte along with the ones queued after it.
+ * An HC-06 is roughly -b 115200 -d 15 -j 5 -B 1024:80. Counters for each
+ * direction are printed on exit (ctrl-c).
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUEUE_LEN       65536       ///< bytes in flight per direction
+#define NEVER           UINT64_MAX
+
+/** Link impairments. */
+typedef struct {
+    uint32_t baud;              ///< 0 for no pacing
+    uint32_t latency;           ///< us
+    uint32_t jitter;            ///< us
+    uint32_t burst;             ///< bytes per burst, 0 for no bursts
+    uint32_t silence;           ///< us of silence after a burst
+    double loss;                ///< probability of losing a byte
+    double corruption;          ///< probability of corrupting a byte
+} link_t;
+
+/** Byte in flight. */
+typedef struct {
+    uint8_t c;
+    uint64_t due;               ///< delivery time, us
+} flight_t;
+
+/** One direction of the link. */
+typedef struct {
+    char const *name;
+    int in;
+    int out;
+    flight_t queue[QUEUE_LEN];
+    uint32_t head;
+    uint32_t tail;
+    uint64_t last_due;          ///< delivery time of the last byte queued
+    uint32_t burst_count;       ///< bytes in the current burst
+    uint32_t max_level;
+    uint32_t received;
+    uint32_t sent;
+    uint32_t lost;
+    uint32_t corrupted;
+    uint32_t overflows;         ///< bytes dropped because the queue was full
+} pipe_t;
+
+static link_t link_config;
+static pipe_t up;
+static pipe_t down;
+static volatile sig_atomic_t done;
+
+/**
+ * Monotonic time in microseconds.
+ */
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Uniform random number in [0, 1).
+ */
+static double random_unit(void)
+{
+    return random() / ((double) RAND_MAX + 1);
+}
+
+/**
+ * Put a tty in raw mode.
+ */
+static int make_raw(int fd)
+{
+    struct termios t;
+
+    if (tcgetattr(fd, &t))
+        return -1;
+    cfmakeraw(&t);
+    return tcsetattr(fd, TCSANOW, &t);
+}
+
+/**
+ * Queue the bytes read from one end, applying the impairments.
+ * @param p link direction
+ * @param buf bytes read
+ * @param n how many
+ * @param now current time, us
+ */
+static void enqueue(pipe_t *p, uint8_t const *buf, ssize_t n, uint64_t now)
+{
+    uint64_t byte_time = link_config.baud ? 10000000ULL / link_config.baud : 0;
+    ssize_t i;
+
+    for (i = 0; i < n; i++) {
+        flight_t *f;
+        uint64_t due;
+        uint32_t level = (p->head - p->tail) % QUEUE_LEN;
+
+        p->received++;
+        if (random_unit() < link_config.loss) {
+            p->lost++;
+            continue;
+        }
+        if (level == QUEUE_LEN - 1) {
+            p->overflows++;
+            continue;
+        }
+        if (level + 1 > p->max_level)
+            p->max_level = level + 1;
+
+        f = &p->queue[p->head];
+        f->c = buf[i];
+        if (random_unit() < link_config.corruption) {
+            f->c ^= 1 << (random() % 8);
+            p->corrupted++;
+        }
+
+        // latency and jitter, but never ahead of the previous byte
+        due = now + link_config.latency;
+        if (link_config.jitter)
+            due += random() % (link_config.jitter + 1);
+        if (due < p->last_due + byte_time)
+            due = p->last_due + byte_time;
+        if (now >= p->last_due + link_config.silence)
+            p->burst_count = 0;     // the link went quiet, this is a new burst
+        if (link_config.burst && ++p->burst_count > link_config.burst) {
+            due += link_config.silence;
+            p->burst_count = 1;
+        }
+        f->due = p->last_due = due;
+        p->head = (p->head + 1) % QUEUE_LEN;
+    }
+}
+
+/**
+ * Deliver the bytes that are due.
+ * @return time the next byte is due, #NEVER if the queue is empty
+ */
+static uint64_t deliver(pipe_t *p, uint64_t now)
+{
+    uint8_t buf[256];
+    size_t n = 0;
+    uint32_t i = p->tail;
+
+    while (i != p->head && p->queue[i].due <= now && n < sizeof(buf)) {
+        buf[n++] = p->queue[i].c;
+        i = (i + 1) % QUEUE_LEN;
+    }
+    if (n) {
+        ssize_t written = write(p->out, buf, n);
+        if (written > 0) {
+            p->tail = (p->tail + written) % QUEUE_LEN;
+            p->sent += written;
+        }
+        if (written != (ssize_t) n)
+            return now + 1000;      // the other end is full, retry in a while
+    }
+    return p->tail == p->head ? NEVER : p->queue[p->tail].due;
+}
+
+static void print_counters(pipe_t *p)
+{
+    fprintf(stderr, "%s: %u received, %u sent, %u lost, %u corrupted, %u overflows, max queue %u\n",
+            p->name, p->received, p->sent, p->lost, p->corrupted, p->overflows, p->max_level);
+}
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    done = 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: linkemu [-b baud] [-d ms] [-j ms] [-B bytes:ms] [-l rate] [-c rate]\n"
+                    "               [-s seed] [-L link] device\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char const *symlink_path = NULL;
+    unsigned seed = time(NULL);
+    unsigned burst, silence;
+    int host, device;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:d:j:B:l:c:s:L:")) != -1) {
+        switch (opt) {
+            case 'b': link_config.baud = strtoul(optarg, NULL, 10); break;
+            case 'd': link_config.latency = atof(optarg) * 1000; break;
+            case 'j': link_config.jitter = atof(optarg) * 1000; break;
+            case 'B':
+                if (sscanf(optarg, "%u:%u", &burst, &silence) != 2)
+                    usage();
+                link_config.burst = burst;
+                link_config.silence = silence * 1000;
+                break;
+            case 'l': link_config.loss = atof(optarg); break;
+            case 'c': link_config.corruption = atof(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            case 'L': symlink_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (argc - optind != 1)
+        usage();
+    srandom(seed);
+
+    // device side
+    device = open(argv[optind], O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (device < 0 || make_raw(device)) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    // host side: a new pseudo terminal
+    host = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (host < 0 || grantpt(host) || unlockpt(host)) {
+        perror("pty");
+        return 1;
+    }
+    {
+        // keep the slave open so the master doesn't hang up between clients
+        int slave = open(ptsname(host), O_RDWR | O_NOCTTY);
+        if (slave < 0 || make_raw(slave)) {
+            perror(ptsname(host));
+            return 1;
+        }
+    }
+    if (symlink_path) {
+        unlink(symlink_path);
+        if (symlink(ptsname(host), symlink_path)) {
+            perror(symlink_path);
+            return 1;
+        }
+    }
+    fprintf(stderr, "linkemu: %s <-> %s (seed %u)\n",
+            symlink_path ? symlink_path : ptsname(host), argv[optind], seed);
+
+    up.name = "host -> device";
+    down.name = "device -> host";
+    up.in = down.out = host;
+    up.out = down.in = device;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!done) {
+        struct pollfd fds[2] = {
+            { host, POLLIN, 0 },
+            { device, POLLIN, 0 },
+        };
+        uint64_t now = now_us();
+        uint64_t next = deliver(&up, now);
+        uint64_t next_down = deliver(&down, now);
+        int timeout = -1;
+        uint8_t buf[256];
+        ssize_t n;
+
+        if (next_down < next)
+            next = next_down;
+        if (next != NEVER)
+            timeout = next > now ? (next - now + 999) / 1000 : 0;
+
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        now = now_us();
+        if (fds[0].revents & POLLIN && (n = read(host, buf, sizeof(buf))) > 0)
+            enqueue(&up, buf, n, now);
+        if (fds[1].revents & POLLIN && (n = read(device, buf, sizeof(buf))) > 0)
+            enqueue(&down, buf, n, now);
+        if (fds[1].revents & (POLLHUP | POLLERR) && !(fds[1].revents & POLLIN)) {
+            fprintf(stderr, "linkemu: %s hung up\n", argv[optind]);
+            break;
+        }
+    }
+
+    print_counters(&up);
+    print_counters(&down);
+    if (symlink_path)
+        unlink(symlink_path);
+    return 0;
+}
@@ -0,0 +1,316 @@
+/**
+ * Benchmark corpus generator.
+ *
+ * Writes a set of Intel hex images that stress the bootloader in
+ * different ways, sized for the app space of an arch:
+ *
+ *     mkcorpus -a 328p|2560 -o dir [-s seed]
+ *
+ *   random.hex     high entropy data, most of the app space
+ *   blank.hex      mostly 0xff, like a binary padded before conversion
+ *   sparse.hex     a few segments with gaps, addressed with 02 and 04 records
+ *   long.hex       16 byte records (the most the bootloader takes) straddling pages
+ *   app.hex        compiled Arduino-style app: vector table, code, .data, odd tail
+ *
+ * The output only depends on the seed, so stored benchmark baselines
+ * stay valid from one run to the next.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_LEN      16              ///< data bytes per record, as objcopy does
+#define MAX_IMAGE       (256 * 1024L)
+
+/** Arch parameters. */
+typedef struct {
+    char const *name;
+    uint32_t app_size;                  ///< flash below the bootloader (NRWW_START)
+    uint8_t vectors;                    ///< interrupt vectors
+} arch_t;
+
+static arch_t const archs[] = {
+    { "328p", 0x7000, 26 },
+    { "2560", 0x3e000, 57 },
+};
+
+static uint32_t rng_state;
+
+/**
+ * xorshift32, so the corpus is the same on every host.
+ */
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/** Hex file being written. */
+typedef struct {
+    FILE *f;
+    uint32_t extension;                 ///< current 02/04 address extension
+} hexfile_t;
+
+/**
+ * Write a record.
+ */
+static void record(hexfile_t *h, uint8_t type, uint16_t address, uint8_t const *data, uint8_t n)
+{
+    uint8_t sum = n + (address >> 8) + address + type;
+    int i;
+
+    fprintf(h->f, ":%02X%04X%02X", n, address, type);
+    for (i = 0; i < n; i++) {
+        fprintf(h->f, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(h->f, "%02X\n", (uint8_t) -sum);
+}
+
+/**
+ * Write an extended linear address (04) record.
+ */
+static void linear_address(hexfile_t *h, uint32_t address)
+{
+    uint8_t upper[2] = { address >> 24, address >> 16 };
+
+    record(h, 0x04, 0, upper, 2);
+    h->extension = address & 0xffff0000;
+}
+
+/**
+ * Write an extended segment address (02) record.
+ */
+static void segment_address(hexfile_t *h, uint32_t address)
+{
+    uint16_t segment = address >> 4;
+    uint8_t data[2] = { segment >> 8, segment };
+
+    record(h, 0x02, 0, data, 2);
+    h->extension = (uint32_t) segment << 4;
+}
+
+/**
+ * Write data records, starting a new 64 KB block with a 04 record
+ * when needed.
+ * @param h hex file
+ * @param address flash address of the data
+ * @param data bytes
+ * @param n how many
+ * @param len bytes per record
+ */
+static void data_records(hexfile_t *h, uint32_t address, uint8_t const *data, uint32_t n, uint8_t len)
+{
+    while (n) {
+        uint32_t chunk = n < len ? n : len;
+        uint32_t offset = address - h->extension;
+
+        if (offset + chunk > 0x10000) {
+            if (offset < 0x10000) {
+                chunk = 0x10000 - offset;   // up to the end of the block
+            }
+            else {
+                linear_address(h, address);
+                continue;
+            }
+        }
+        record(h, 0x00, offset, data, chunk);
+        address += chunk;
+        data += chunk;
+        n -= chunk;
+    }
+}
+
+static hexfile_t open_hex(char const *dir, char const *name)
+{
+    hexfile_t h = { NULL, 0 };
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!(h.f = fopen(path, "w"))) {
+        perror(path);
+        exit(1);
+    }
+    return h;
+}
+
+static void close_hex(hexfile_t *h)
+{
+    record(h, 0x01, 0, NULL, 0);
+    fclose(h->f);
+}
+
+/**
+ * High entropy data over 90% of the app space.
+ */
+static void make_random(arch_t const *arch, char const *dir, uint8_t *image)
+{
+    hexfile_t h = open_hex(dir, "random.hex");
+    uint32_t n = arch->app_size / 10 * 9;
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+        image[i] = rng();
+    data_records(&h, 0, image, n, RECORD_LEN);
+    close_hex(&h);
+}
+
+/**
+ * Half the app space, 95% of it 0xff in runs, with short stretches of
+ * data in between.
+ */
+static void make_blank(arch_t const *arch, char const *dir, uint8_t *image)
+{
+    hexfile_t h = open_hex(dir, "blank.hex");
+    uint32_t n = arch->app_size / 2;
+    uint32_t i;
+
+    memset(image, 0xff, n);
+    for (i = 0; i < n / 20; i++) {
+        uint32_t at = rng() % (n - 8);
+        image[at] = rng() & 0xfe;
+    }
+    image[0] = 0x0c;                    // a reset vector, as any image has
+    data_records(&h, 0, image, n, RECORD_LEN);
+    close_hex(&h);
+}
+
+/**
+ * Segments scattered over the app space, the ones below 1 MB addressed
+ * with 02 records and, on the 2560, the ones above 64 KB with 04
+ * records.
+ */
+static void make_sparse(arch_t const *arch, char const *dir, uint8_t *image)
+{
+    hexfile_t h = open_hex(dir, "sparse.hex");
+    uint32_t segments = 6;
+    uint32_t spacing = arch->app_size / segments;
+    uint32_t s, i;
+
+    for (s = 0; s < segments; s++) {
+        uint32_t address = s * spacing / 256 * 256;
+        uint32_t n = 256 + rng() % (spacing / 4);
+
+        for (i = 0; i < n; i++)
+            image[i] = rng();
+        if (address + n <= 0x10000 && s % 2) {
+            // 02 record for the segment start, offsets from 0
+            segment_address(&h, address);
+        }
+        else if (address >= 0x10000) {
+            linear_address(&h, address);
+        }
+        else if (h.extension) {
+            linear_address(&h, 0);
+        }
+        data_records(&h, address, image, n, RECORD_LEN);
+    }
+    close_hex(&h);
+}
+
+/**
+ * Full 16 byte records, shifted so that one in eight straddles a page.
+ */
+static void make_long(arch_t const *arch, char const *dir, uint8_t *image)
+{
+    hexfile_t h = open_hex(dir, "long.hex");
+    uint32_t n = arch->app_size / 4;
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+        image[i] = rng() % 3 ? rng() : 0;
+    data_records(&h, 0, image, 7, RECORD_LEN);
+    data_records(&h, 7, image + 7, n - 7, RECORD_LEN);
+    close_hex(&h);
+}
+
+/**
+ * Something that looks like avr-gcc output for an Arduino sketch: a
+ * jmp vector table, code made of the most common instructions, the
+ * .data initializers (strings) and a short last record.
+ */
+static void make_app(arch_t const *arch, char const *dir, uint8_t *image)
+{
+    static uint16_t const opcodes[] = {
+        0xe080, 0xe090, 0x2f80, 0x2f91, 0x930f, 0x931f, 0x910f, 0x911f,     // ldi, mov, push, pop
+        0x9508, 0x0f88, 0x1f99, 0x9601, 0x9701, 0x1789, 0xf409, 0xf011,     // ret, add, adc, adiw, sbiw, cp, brne, breq
+        0x8180, 0x8380, 0x9180, 0x9380, 0xcfff, 0xdfff,                     // ldd, std, lds, sts, rjmp, rcall
+    };
+    static char const strings[] = "Hello world!\r\nPress 'b' to reboot into the bootloader\r\n%d %s\r\n";
+    hexfile_t h = open_hex(dir, "app.hex");
+    uint32_t code = arch->app_size / 3;
+    uint32_t n = 0;
+    uint32_t i;
+
+    // vector table: jmp __vector_n or __bad_interrupt
+    for (i = 0; i < arch->vectors; i++) {
+        uint16_t target = (i == 0 ? 0x100 : rng() % 4 ? 0x2a0 : 0x300 + i * 8) / 2;
+        image[n++] = 0x0c;
+        image[n++] = 0x94;
+        image[n++] = target;
+        image[n++] = target >> 8;
+    }
+    // code
+    while (n < code) {
+        uint16_t op = opcodes[rng() % (sizeof(opcodes) / sizeof(opcodes[0]))];
+        op |= rng() & 0x00f0;           // vary the registers
+        image[n++] = op;
+        image[n++] = op >> 8;
+        if ((op & 0xfc0f) == 0x9000) {  // lds/sts take an address
+            uint16_t address = 0x100 + rng() % 0x400;
+            image[n++] = address;
+            image[n++] = address >> 8;
+        }
+    }
+    // .data, then an odd length tail
+    while (n < code + 3 * sizeof(strings)) {
+        memcpy(image + n, strings, sizeof(strings));
+        n += sizeof(strings);
+    }
+    n += 5;
+    data_records(&h, 0, image, n, RECORD_LEN);
+    close_hex(&h);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mkcorpus -a 328p|2560 -o dir [-s seed]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t image[MAX_IMAGE];
+    arch_t const *arch = NULL;
+    char const *dir = NULL;
+    uint32_t seed = 1;
+    int opt;
+    unsigned i;
+
+    while ((opt = getopt(argc, argv, "a:o:s:")) != -1) {
+        switch (opt) {
+            case 'a':
+                for (i = 0; i < sizeof(archs) / sizeof(archs[0]); i++)
+                    if (!strcmp(optarg, archs[i].name))
+                        arch = &archs[i];
+                break;
+            case 'o': dir = optarg; break;
+            case 's': seed = strtoul(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if (!arch || !dir || !seed)
+        usage();
+
+    rng_state = seed;
+    make_random(arch, dir, image);
+    make_blank(arch, dir, image);
+    make_sparse(arch, dir, image);
+    make_long(arch, dir, image);
+    make_app(arch, dir, image);
+    return 0;
+}
@@ -0,0 +1,363 @@
+/**
+ * Running hexloader in simavr, see sim.h.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+#include "avr_uart.h"
+#include "sim.h"
+
+#define UBRR0L          0xc4            ///< UBRR0 data address, the same on the 328p and the 2560
+#define UBRR0H          0xc5
+#define UART_FIFO_LEN   2               ///< bytes the AVR UART holds before overrunning
+
+#define PROMPT          ">: "           ///< bootloader waiting for input
+#define OK              " OK! ("        ///< flash or verify pass done
+#define REBOOT          "Rebooting into bootloader"
+
+#define BOOT_TIMEOUT    1.0             ///< seconds to wait for the first prompt
+#define PASTE_TIMEOUT   2.0             ///< seconds to wait for " OK!" on top of the transfer time
+
+enum { WAIT_PROMPT, FLASHING, WAIT_VERIFY, VERIFYING, DONE };
+
+/** State of a #sim_upload run. */
+typedef struct {
+    avr_t *avr;
+    avr_uart_t *uart;                   ///< UART 0 model
+    avr_irq_t *rx;                      ///< bytes into the AVR
+    char *out;                          ///< everything the bootloader sent, NUL terminated
+    size_t out_len;
+    size_t out_size;
+    size_t mark;                        ///< start of the output of the current pass
+    size_t checked;                     ///< output searched for markers so far
+    char const *hex;                    ///< file being pasted
+    size_t len;
+    size_t sent;                        ///< bytes of #hex pasted so far
+    avr_cycle_count_t byte_cycles;      ///< cycles per 10 bit frame
+    int overrun;
+} session_t;
+
+/**
+ * Baud rate the bootloader ends up with, given its UBRR rounding (see
+ * SERIAL_2X_UBRRVAL in hal-avr.c).
+ * @param f_cpu clock in Hz
+ * @param baud requested baud rate
+ * @return the actual baud rate
+ */
+uint32_t sim_actual_baud(uint32_t f_cpu, uint32_t baud)
+{
+    uint32_t ubrr = ((f_cpu / 8 + baud / 2) / baud) - 1;
+    return f_cpu / 8 / (ubrr + 1);
+}
+
+/**
+ * Read a whole file.
+ * @param path file name
+ * @param len set to the file length
+ * @return the contents (malloc'ed, NUL terminated), NULL on error
+ */
+char *sim_read_file(char const *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long n;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(n + 1);
+    if (buf && fread(buf, 1, n, f) != (size_t) n) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    if (buf) {
+        buf[n] = '\0';
+        *len = n;
+    }
+    return buf;
+}
+
+/**
+ * Write an I/O register the way the AVR would, so that the peripheral
+ * model sees it.
+ */
+static void io_write(avr_t *avr, uint16_t address, uint8_t value)
+{
+    int io = AVR_DATA_TO_IO(address);
+
+    if (avr->io[io].w.c)
+        avr->io[io].w.c(avr, address, value, avr->io[io].w.param);
+    else
+        avr->data[address] = value;
+}
+
+/**
+ * Collect the bootloader output.
+ */
+static void uart_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    session_t *s = param;
+    (void) irq;
+
+    if (s->out_len + 1 >= s->out_size) {
+        s->out_size = s->out_size ? s->out_size * 2 : 4096;
+        s->out = realloc(s->out, s->out_size);
+    }
+    s->out[s->out_len++] = value;
+    s->out[s->out_len] = '\0';
+}
+
+/**
+ * Paste the next byte, one frame time after the previous one. A real
+ * UART holds #UART_FIFO_LEN bytes, anything beyond that still unread
+ * by the AVR is an overrun.
+ */
+static avr_cycle_count_t send_byte(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+    session_t *s = param;
+    (void) avr;
+
+    if (uart_fifo_get_read_size(&s->uart->input) >= UART_FIFO_LEN)
+        s->overrun = 1;
+    avr_raise_irq(s->rx, (uint8_t) s->hex[s->sent++]);
+    return s->sent < s->len ? when + s->byte_cycles : 0;
+}
+
+/**
+ * Start pasting the hex file.
+ */
+static void paste(session_t *s)
+{
+    s->sent = 0;
+    avr_cycle_timer_register(s->avr, s->byte_cycles, send_byte, s);
+}
+
+/**
+ * Look for a marker in the output of the current pass, not past what
+ * was already searched.
+ * @return the marker position, NULL if not found
+ */
+static char *find(session_t *s, char const *marker)
+{
+    size_t from = s->checked > s->mark + strlen(marker) ? s->checked - strlen(marker) : s->mark;
+    return strstr(s->out + from, marker);
+}
+
+/**
+ * Milliseconds of simulated time since a given cycle.
+ */
+static double ms_since(avr_t *avr, avr_cycle_count_t start)
+{
+    return (avr->cycle - start) * 1000.0 / avr->frequency;
+}
+
+/**
+ * Copy the bootloader error line of the current pass into the result.
+ */
+static void error_message(session_t *s, sim_result_t *result)
+{
+    char *line = strstr(s->out + s->mark, "rror");
+    size_t n;
+
+    if (!line) {
+        strcpy(result->message, REBOOT);
+        return;
+    }
+    while (line > s->out + s->mark && line[-1] != '\n')
+        line--;
+    n = strcspn(line, "\r\n");
+    if (n >= sizeof(result->message))
+        n = sizeof(result->message) - 1;
+    memcpy(result->message, line, n);
+    result->message[n] = '\0';
+}
+
+/**
+ * Find the simulated UART 0.
+ */
+static avr_uart_t *find_uart(avr_t *avr)
+{
+    avr_io_t *io;
+
+    for (io = avr->io_port; io; io = io->next) {
+        if (!strcmp(io->kind, "uart") && ((avr_uart_t *) io)->name == '0')
+            return (avr_uart_t *) io;
+    }
+    return NULL;
+}
+
+/**
+ * Look up a symbol in an avr-nm listing (see the sym target).
+ * @param path listing
+ * @param name symbol
+ * @return its address, #SIM_NO_SYMBOL if not found
+ */
+uint32_t sim_symbol(char const *path, char const *name)
+{
+    FILE *f = fopen(path, "r");
+    uint32_t address = SIM_NO_SYMBOL;
+    char buf[128];
+
+    if (!f)
+        return SIM_NO_SYMBOL;
+    while (address == SIM_NO_SYMBOL && fgets(buf, sizeof(buf), f)) {
+        unsigned long value;
+        char symbol[64];
+
+        if (sscanf(buf, "%lx %*c %63s", &value, symbol) == 2 && !strcmp(symbol, name))
+            address = value;
+    }
+    fclose(f);
+    return address;
+}
+
+/**
+ * Make a chip running the bootloader, out of reset.
+ * The UART 0 output isn't echoed to stdout, hook UART_IRQ_OUTPUT to get it.
+ * @param target chip and bootloader ELF
+ * @return the simulated chip
+ */
+avr_t *sim_load(sim_target_t const *target)
+{
+    elf_firmware_t fw;
+    avr_t *avr;
+    uint32_t flags = 0;
+
+    memset(&fw, 0, sizeof(fw));
+    if (elf_read_firmware(target->elf, &fw)) {
+        fprintf(stderr, "%s: can't load the firmware\n", target->elf);
+        exit(1);
+    }
+    avr = avr_make_mcu_by_name(target->mcu);
+    if (!avr) {
+        fprintf(stderr, "%s: unknown mcu\n", target->mcu);
+        exit(1);
+    }
+    avr_init(avr);
+    avr->log = LOG_ERROR;
+    avr_load_firmware(avr, &fw);
+    avr->frequency = target->f_cpu;
+    avr->pc = avr->reset_pc = fw.flashbase;     // BOOTRST fuse
+
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+    return avr;
+}
+
+/**
+ * Boot the bootloader on a blank chip and upload a hex file.
+ * The UART is switched to @p baud when the first prompt shows up, and
+ * the file is pasted twice to flash and verify it.
+ * @param target chip and bootloader ELF
+ * @param hex hex file contents
+ * @param len hex file length
+ * @param baud requested baud rate
+ * @param result filled with the outcome and the timings
+ * @return result->status
+ */
+int sim_upload(sim_target_t const *target, char const *hex, size_t len, uint32_t baud,
+        sim_result_t *result)
+{
+    session_t s;
+    uint16_t ubrr;
+    avr_cycle_count_t start = 0;
+    avr_cycle_count_t deadline;
+    int state = WAIT_PROMPT;
+    int prev;
+    char *p;
+
+    memset(result, 0, sizeof(*result));
+    memset(&s, 0, sizeof(s));
+    s.hex = hex;
+    s.len = len;
+
+    s.avr = sim_load(target);
+
+    avr_irq_register_notify(avr_io_getirq(s.avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+            uart_output, &s);
+    s.rx = avr_io_getirq(s.avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+    s.uart = find_uart(s.avr);
+
+    result->baud = sim_actual_baud(target->f_cpu, baud);
+    s.byte_cycles = (avr_cycle_count_t) target->f_cpu * 10 / result->baud;
+    ubrr = ((target->f_cpu / 8 + baud / 2) / baud) - 1;
+
+    deadline = BOOT_TIMEOUT * target->f_cpu;
+    while (state != DONE) {
+        uint32_t pc = s.avr->pc;
+        int sleeping = s.avr->state == cpu_Sleeping;
+        avr_cycle_count_t cycle = s.avr->cycle;
+        int cpu = avr_run(s.avr);
+
+        if (target->step && (state == FLASHING || state == VERIFYING))
+            target->step(target->param, pc, s.avr->cycle - cycle, sleeping);
+        if (cpu == cpu_Done || cpu == cpu_Crashed) {
+            result->status = SIM_CRASH;
+            break;
+        }
+        if (s.overrun) {
+            result->status = SIM_OVERRUN;
+            break;
+        }
+        if (s.avr->cycle > deadline) {
+            result->status = SIM_TIMEOUT;
+            break;
+        }
+        if (s.checked == s.out_len)
+            continue;
+
+        prev = state;
+        if (find(&s, REBOOT)) {
+            error_message(&s, result);
+            result->status = SIM_ERROR;
+            break;
+        }
+        switch (state) {
+            case WAIT_PROMPT:
+            case WAIT_VERIFY:
+                if ((p = find(&s, PROMPT))) {
+                    if (state == WAIT_PROMPT) {
+                        // the bootloader is idle at the prompt, a good time to switch
+                        io_write(s.avr, UBRR0H, ubrr >> 8);
+                        io_write(s.avr, UBRR0L, ubrr & 0xff);
+                    }
+                    s.mark = p + strlen(PROMPT) - s.out;
+                    start = s.avr->cycle;
+                    deadline = start + s.byte_cycles * len + PASTE_TIMEOUT * target->f_cpu;
+                    paste(&s);
+                    state++;
+                }
+                break;
+            case FLASHING:
+            case VERIFYING:
+                if ((p = find(&s, OK))) {
+                    unsigned rx_max = 0;
+                    if (state == FLASHING)
+                        result->flash_ms = ms_since(s.avr, start);
+                    else
+                        result->verify_ms = ms_since(s.avr, start);
+                    sscanf(p + strlen(OK), "%*ums, rx max %u", &rx_max);
+                    if (rx_max > result->rx_max)
+                        result->rx_max = rx_max;
+                    s.mark = p + strlen(OK) - s.out;
+                    deadline = s.avr->cycle + BOOT_TIMEOUT * target->f_cpu;
+                    state++;
+                }
+                break;
+        }
+        // on to the next pass: its marker may be in the output already
+        s.checked = state == prev ? s.out_len : s.mark;
+    }
+
+    avr_terminate(s.avr);
+    free(s.out);
+    return result->status;
+}
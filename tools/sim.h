@@ -0,0 +1,60 @@
+#pragma once
+
+/**
+ * Running hexloader in simavr.
+ *
+ * #sim_load makes a simulated chip with the bootloader ELF on it, and
+ * #sim_symbol finds addresses in the avr-nm listings of the sym target.
+ *
+ * #sim_upload loads the bootloader into a fresh simulated chip, switches its
+ * UART to the requested baud rate once the prompt shows up and pastes a
+ * hex file twice (flash, then verify) at exactly the line rate, with no
+ * flow control, the way a terminal would. Times are simulated time.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "sim_avr.h"
+
+#define SIM_OK          0       ///< upload flashed and verified
+#define SIM_ERROR       1       ///< the bootloader rejected the upload (see #sim_result_t.message)
+#define SIM_OVERRUN     2       ///< the UART input backed up: bytes would have been lost on a real chip
+#define SIM_TIMEOUT     3       ///< the bootloader stopped answering
+#define SIM_CRASH       4       ///< simavr stopped the CPU
+
+#define SIM_NO_SYMBOL   0xffffffff  ///< #sim_symbol didn't find it
+
+/**
+ * Called for every instruction run while the hex file is being pasted
+ * (or for every stretch of sleep).
+ * @param param #sim_target_t.param
+ * @param pc byte address of the instruction
+ * @param cycles cycles it took, including any interrupt entry
+ * @param sleeping 1 if the CPU was asleep at @p pc
+ */
+typedef void (*sim_step_t)(void *param, uint32_t pc, uint32_t cycles, int sleeping);
+
+/** Chip and firmware to simulate. */
+typedef struct {
+    const char *elf;            ///< bootloader ELF
+    const char *mcu;            ///< simavr core name, eg. atmega328p
+    uint32_t f_cpu;             ///< clock in Hz
+    sim_step_t step;            ///< optional per instruction hook
+    void *param;                ///< parameter for #step
+} sim_target_t;
+
+/** Outcome of #sim_upload. */
+typedef struct {
+    int status;                 ///< one of the SIM_* results
+    uint32_t baud;              ///< actual baud rate, after UBRR rounding
+    double flash_ms;            ///< first byte of the first paste to " OK!"
+    double verify_ms;           ///< first byte of the second paste to " OK!"
+    unsigned rx_max;            ///< rx buffer high-water mark, as reported by the bootloader
+    char message[80];           ///< bootloader error line, for #SIM_ERROR
+} sim_result_t;
+
+uint32_t sim_actual_baud(uint32_t f_cpu, uint32_t baud);
+uint32_t sim_symbol(char const *path, char const *name);
+avr_t *sim_load(sim_target_t const *target);
+int sim_upload(sim_target_t const *target, char const *hex, size_t len, uint32_t baud,
+        sim_result_t *result);
+char *sim_read_file(char const *path, size_t *len);
@@ -0,0 +1,153 @@
+/**
+ * End-to-end upload benchmark of the bootloader in simavr.
+ *
+ * Runs the real bootloader ELF in simavr and pastes each hex file at
+ * increasing baud rates, with no flow control, to find the highest rate
+ * that flashes and verifies without losing a byte:
+ *
+ *     simbench -m atmega328p -f 16000000 [-b 115200,230400,...]
+ *              [-o report.json] hexloader.elf file.hex...
+ *
+ * A table is printed on stdout and, with -o, a JSON report is written
+ * with every run plus, per file, the highest working baud rate and the
+ * flash and verify times at that rate. Baud rates are the actual ones,
+ * after UBRR rounding, so 230400 shows up as 222222 at 16 MHz.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+#define MAX_BAUDS       16
+#define DEFAULT_BAUDS   "57600,115200,230400,250000,500000,1000000"
+
+static char const *status_names[] = { "ok", "error", "overrun", "timeout", "crash" };
+
+/**
+ * Print a JSON string.
+ */
+static void json_string(FILE *f, char const *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < ' ')
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/**
+ * Parse a comma separated list of baud rates.
+ * @return number of rates, 0 on error
+ */
+static int parse_bauds(char *list, uint32_t *bauds)
+{
+    int n = 0;
+    char *tok;
+
+    for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == MAX_BAUDS || !(bauds[n] = strtoul(tok, NULL, 10)))
+            return 0;
+        n++;
+    }
+    return n;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: simbench -m mcu -f hz [-b baud,...] [-o report.json] hexloader.elf file.hex...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    sim_target_t target = { 0 };
+    char default_bauds[] = DEFAULT_BAUDS;
+    char *baud_list = default_bauds;
+    char const *report_path = NULL;
+    FILE *report = NULL;
+    uint32_t bauds[MAX_BAUDS];
+    int nbauds;
+    int failed = 0;
+    int opt;
+    int i, j;
+
+    while ((opt = getopt(argc, argv, "m:f:b:o:")) != -1) {
+        switch (opt) {
+            case 'm': target.mcu = optarg; break;
+            case 'f': target.f_cpu = strtoul(optarg, NULL, 10); break;
+            case 'b': baud_list = optarg; break;
+            case 'o': report_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (!target.mcu || !target.f_cpu || argc - optind < 2)
+        usage();
+    if (!(nbauds = parse_bauds(baud_list, bauds)))
+        usage();
+    target.elf = argv[optind++];
+
+    if (report_path && !(report = fopen(report_path, "w"))) {
+        perror(report_path);
+        return 1;
+    }
+    if (report) {
+        fprintf(report, "{\n  \"mcu\": ");
+        json_string(report, target.mcu);
+        fprintf(report, ",\n  \"f_cpu\": %u,\n  \"firmware\": ", target.f_cpu);
+        json_string(report, target.elf);
+        fprintf(report, ",\n  \"images\": [");
+    }
+
+    printf("%-40s %8s %-8s %8s %10s %10s %s\n",
+            "image", "baud", "result", "rx max", "flash ms", "verify ms", "");
+    for (i = optind; i < argc; i++) {
+        sim_result_t best = { 0 };
+        size_t len;
+        char *hex = sim_read_file(argv[i], &len);
+
+        if (!hex) {
+            perror(argv[i]);
+            return 1;
+        }
+        if (report) {
+            fprintf(report, "%s\n    {\"image\": ", i == optind ? "" : ",");
+            json_string(report, argv[i]);
+            fprintf(report, ", \"bytes\": %zu, \"runs\": [", len);
+        }
+        for (j = 0; j < nbauds; j++) {
+            sim_result_t r;
+
+            sim_upload(&target, hex, len, bauds[j], &r);
+            printf("%-40s %8u %-8s %8u %10.1f %10.1f %s\n", argv[i], r.baud,
+                    status_names[r.status], r.rx_max, r.flash_ms, r.verify_ms, r.message);
+            if (r.status == SIM_OK && r.baud > best.baud)
+                best = r;
+            if (report) {
+                fprintf(report, "%s\n      {\"baud\": %u, \"result\": \"%s\", \"rx_max\": %u, "
+                        "\"flash_ms\": %.1f, \"verify_ms\": %.1f, \"message\": ",
+                        j ? "," : "", r.baud, status_names[r.status], r.rx_max,
+                        r.flash_ms, r.verify_ms);
+                json_string(report, r.message);
+                fprintf(report, "}");
+            }
+        }
+        if (!best.baud)
+            failed = 1;
+        if (report) {
+            fprintf(report, "\n    ], \"max_baud\": %u, \"flash_ms\": %.1f, \"verify_ms\": %.1f}",
+                    best.baud, best.flash_ms, best.verify_ms);
+        }
+        free(hex);
+    }
+    if (report) {
+        fprintf(report, "\n  ]\n}\n");
+        fclose(report);
+    }
+    return failed;
+}
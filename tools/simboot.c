@@ -0,0 +1,273 @@
+/**
+ * Boot path latency benchmark in simavr.
+ *
+ * Runs the bootloader along with an app (test-reboot, or any app that
+ * reboots into the bootloader when it gets a 'b') and times the three
+ * transitions we go through every day:
+ *
+ *     simboot -m atmega328p -f 16000000 [-o report.json]
+ *             hexloader.elf hexloader.sym app.elf app.sym
+ *
+ *   cold boot -> app main      power on with an app in flash
+ *   app 'b' -> prompt          the app reboots into the bootloader
+ *   'q' -> app main            the bootloader jumps (or reboots) into the app
+ *
+ * Each one is split into its parts: serial output, watchdog timeouts,
+ * startup code, init in bootloader() and the banner. Transitions end
+ * when the app reaches main() or when the last byte of the prompt is
+ * sent. Times are simulated time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_uart.h"
+#include "sim.h"
+
+#define TIMEOUT         2.0             ///< seconds for any step of a transition
+#define MAX_PARTS       6
+#define TRANSITIONS     3
+
+#define APP_READY       "bootloader\r\n"        ///< end of the test-reboot banner
+#define PROMPT          ">: "
+
+enum { UNTIL_PC, UNTIL_RESET, UNTIL_OUTPUT };
+
+/** Part of a transition. */
+typedef struct {
+    char const *name;
+    double ms;
+} part_t;
+
+/** A timed transition. */
+typedef struct {
+    char const *name;
+    double ms;
+    part_t parts[MAX_PARTS];
+    int count;
+} transition_t;
+
+/** Simulation state. */
+typedef struct {
+    avr_t *avr;
+    avr_irq_t *rx;                      ///< bytes into the AVR
+    uint64_t now;                       ///< cycles since power on, across resets
+    uint64_t first_tx;                  ///< time of the first byte sent since #clear_output, 0 if none
+    uint64_t last_tx;                   ///< time of the last byte sent
+    uint64_t last_reset;                ///< time of the last reset, 0 if none
+    char out[1024];                     ///< output since #clear_output, NUL terminated
+    size_t out_len;
+} boot_t;
+
+/**
+ * Collect the output and note when it's sent.
+ */
+static void uart_output(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    boot_t *b = param;
+    (void) irq;
+
+    if (!b->first_tx)
+        b->first_tx = b->now;
+    b->last_tx = b->now;
+    if (b->out_len < sizeof(b->out) - 1) {
+        b->out[b->out_len++] = value;
+        b->out[b->out_len] = '\0';
+    }
+}
+
+static void clear_output(boot_t *b)
+{
+    b->out_len = 0;
+    b->out[0] = '\0';
+    b->first_tx = 0;
+}
+
+/**
+ * Type something: the bytes go into the UART model, which hands them
+ * to the AVR at the line rate.
+ */
+static void type(boot_t *b, char const *s)
+{
+    while (*s)
+        avr_raise_irq(b->rx, (uint8_t) *s++);
+}
+
+/**
+ * Run until the CPU gets to an address, resets or sends some text.
+ * @param b simulation
+ * @param until one of UNTIL_PC, UNTIL_RESET or UNTIL_OUTPUT
+ * @param pc address for UNTIL_PC
+ * @param text output for UNTIL_OUTPUT
+ * @return the time it happened, in cycles
+ */
+static uint64_t run_until(boot_t *b, int until, uint32_t pc, char const *text)
+{
+    uint64_t deadline = b->now + TIMEOUT * b->avr->frequency;
+
+    for (;;) {
+        avr_cycle_count_t cycle = b->avr->cycle;
+        uint32_t last_pc = b->avr->pc;
+        int cpu = avr_run(b->avr);
+        int reset;
+
+        // simavr may restart the cycle count on reset
+        b->now += b->avr->cycle >= cycle ? b->avr->cycle - cycle : b->avr->cycle;
+        reset = b->avr->pc == b->avr->reset_pc && last_pc != b->avr->reset_pc;
+        if (reset)
+            b->last_reset = b->now;
+
+        if (cpu == cpu_Done || cpu == cpu_Crashed) {
+            fprintf(stderr, "simboot: the CPU stopped at %04x\n", last_pc);
+            exit(1);
+        }
+        if ((until == UNTIL_PC && b->avr->pc == pc)
+                || (until == UNTIL_RESET && reset)
+                || (until == UNTIL_OUTPUT && strstr(b->out, text)))
+            return b->now;
+        if (b->now > deadline) {
+            fprintf(stderr, "simboot: timeout waiting for %s\n",
+                    until == UNTIL_PC ? "an address" : until == UNTIL_RESET ? "a reset" : text);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Add a part to a transition.
+ */
+static void part(boot_t *b, transition_t *t, char const *name, uint64_t from, uint64_t to)
+{
+    double ms = (to - from) * 1000.0 / b->avr->frequency;
+
+    t->parts[t->count].name = name;
+    t->parts[t->count].ms = ms;
+    t->count++;
+    t->ms += ms;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: simboot -m mcu -f hz [-o report.json] hexloader.elf hexloader.sym app.elf app.sym\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static boot_t b;
+    sim_target_t target = { 0 };
+    static transition_t t[TRANSITIONS];
+    char const *report_path = NULL;
+    char const *app_elf, *app_sym, *loader_sym;
+    elf_firmware_t app;
+    uint32_t main_address, bootloader_address;
+    uint64_t t0, reset, app_start, entry, prompt, sent;
+    int opt;
+    int i, j;
+
+    while ((opt = getopt(argc, argv, "m:f:o:")) != -1) {
+        switch (opt) {
+            case 'm': target.mcu = optarg; break;
+            case 'f': target.f_cpu = strtoul(optarg, NULL, 10); break;
+            case 'o': report_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (!target.mcu || !target.f_cpu || argc - optind != 4)
+        usage();
+    target.elf = argv[optind];
+    loader_sym = argv[optind + 1];
+    app_elf = argv[optind + 2];
+    app_sym = argv[optind + 3];
+
+    bootloader_address = sim_symbol(loader_sym, "bootloader");
+    main_address = sim_symbol(app_sym, "main");
+    if (bootloader_address == SIM_NO_SYMBOL || main_address == SIM_NO_SYMBOL) {
+        fprintf(stderr, "simboot: bootloader() or main() missing from the symbol tables\n");
+        return 1;
+    }
+
+    t[0].name = "cold boot -> app main";
+    t[1].name = "app 'b' -> prompt";
+    t[2].name = "'q' -> app main";
+
+    // bootloader plus app, as if flashed with the bootloader
+    b.avr = sim_load(&target);
+    memset(&app, 0, sizeof(app));
+    if (elf_read_firmware(app_elf, &app)) {
+        fprintf(stderr, "%s: can't load the app\n", app_elf);
+        return 1;
+    }
+    avr_loadcode(b.avr, app.flash, app.flashsize, app.flashbase);
+    avr_irq_register_notify(avr_io_getirq(b.avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+            uart_output, &b);
+    b.rx = avr_io_getirq(b.avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+
+    // power on: the bootloader goes straight into the app
+    app_start = run_until(&b, UNTIL_PC, 0, NULL);
+    part(&b, &t[0], "bootloader", 0, app_start);
+    part(&b, &t[0], "app startup", app_start, run_until(&b, UNTIL_PC, main_address, NULL));
+
+    // app -> bootloader
+    run_until(&b, UNTIL_OUTPUT, 0, APP_READY);
+    clear_output(&b);
+    t0 = b.now;
+    type(&b, "b");
+    reset = run_until(&b, UNTIL_RESET, 0, NULL);
+    sent = b.first_tx ? b.last_tx : t0;
+    entry = run_until(&b, UNTIL_PC, bootloader_address, NULL);
+    part(&b, &t[1], "app reply", t0, sent);
+    part(&b, &t[1], "watchdog", sent, reset);
+    part(&b, &t[1], "startup", reset, entry);
+    clear_output(&b);
+    prompt = run_until(&b, UNTIL_OUTPUT, 0, PROMPT);
+    part(&b, &t[1], "bootloader() init", entry, b.first_tx);
+    part(&b, &t[1], "banner", b.first_tx, prompt);
+
+    // bootloader -> app: straight jump once the line is quiet, or through
+    // a watchdog reset with older bootloaders
+    clear_output(&b);
+    t0 = b.now;
+    type(&b, "q\r");
+    app_start = run_until(&b, UNTIL_PC, 0, NULL);
+    sent = b.first_tx ? b.last_tx : t0;
+    part(&b, &t[2], "command and reply", t0, sent);
+    if (b.last_reset > t0) {
+        part(&b, &t[2], "watchdog", sent, b.last_reset);
+        part(&b, &t[2], "bootloader", b.last_reset, app_start);
+    }
+    else {
+        part(&b, &t[2], "quiet wait and jump", sent, app_start);
+    }
+    part(&b, &t[2], "app startup", app_start, run_until(&b, UNTIL_PC, main_address, NULL));
+
+    for (i = 0; i < TRANSITIONS; i++) {
+        printf("%-24s %9.3f ms\n", t[i].name, t[i].ms);
+        for (j = 0; j < t[i].count; j++)
+            printf("    %-20s %9.3f ms  %5.1f%%\n", t[i].parts[j].name, t[i].parts[j].ms,
+                    t[i].ms > 0 ? 100 * t[i].parts[j].ms / t[i].ms : 0);
+    }
+
+    if (report_path) {
+        FILE *f = fopen(report_path, "w");
+        if (!f) {
+            perror(report_path);
+            return 1;
+        }
+        fprintf(f, "{\n  \"mcu\": \"%s\",\n  \"f_cpu\": %u,\n  \"transitions\": [", target.mcu,
+                target.f_cpu);
+        for (i = 0; i < TRANSITIONS; i++) {
+            fprintf(f, "%s\n    {\"name\": \"%s\", \"ms\": %.3f, \"parts\": {", i ? "," : "",
+                    t[i].name, t[i].ms);
+            for (j = 0; j < t[i].count; j++)
+                fprintf(f, "%s\"%s\": %.3f", j ? ", " : "", t[i].parts[j].name, t[i].parts[j].ms);
+            fprintf(f, "}}");
+        }
+        fprintf(f, "\n  ]\n}\n");
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+/**
+ * Cycle-level flat profile of an upload in simavr.
+ *
+ * Pastes a hex file into the bootloader running in simavr (see sim.h)
+ * and charges the cycles of every instruction run while data is flowing
+ * to the function holding it, according to the symbol table made by
+ * 'make sym' (avr-nm -n):
+ *
+ *     simprofile -m atmega328p -f 16000000 [-b 115200] -s hexloader.sym
+ *                hexloader.elf file.hex
+ *
+ * Functions are listed by cycles, with the number of times they were
+ * entered, followed by the time asleep and the share of the ISRs
+ * (__vector_* symbols). Functions inlined by the compiler are counted in
+ * their caller.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+#define MAX_SYMBOLS     512
+#define TEXT_END        0x800000        ///< avr-nm shows RAM symbols from here on
+
+/** Function in the symbol table, and the cycles charged to it. */
+typedef struct {
+    uint32_t address;
+    char name[48];
+    uint64_t cycles;
+    uint32_t calls;
+} symbol_t;
+
+/** Profile being collected. */
+typedef struct {
+    symbol_t symbols[MAX_SYMBOLS];
+    int count;
+    uint64_t asleep;
+    uint64_t unknown;                   ///< cycles outside any known function
+} profile_t;
+
+static int by_address(void const *a, void const *b)
+{
+    uint32_t x = ((symbol_t const *) a)->address;
+    uint32_t y = ((symbol_t const *) b)->address;
+    return x < y ? -1 : x > y;
+}
+
+static int by_cycles(void const *a, void const *b)
+{
+    uint64_t x = ((symbol_t const *) a)->cycles;
+    uint64_t y = ((symbol_t const *) b)->cycles;
+    return x > y ? -1 : x < y;
+}
+
+/**
+ * Load the code symbols of an avr-nm -n listing.
+ * @return 0 on success
+ */
+static int load_symbols(char const *path, profile_t *profile)
+{
+    FILE *f = fopen(path, "r");
+    char buf[128];
+
+    if (!f)
+        return -1;
+    while (fgets(buf, sizeof(buf), f) && profile->count < MAX_SYMBOLS) {
+        symbol_t *sym = &profile->symbols[profile->count];
+        unsigned long address;
+        char type;
+
+        if (sscanf(buf, "%lx %c %47s", &address, &type, sym->name) != 3)
+            continue;
+        if ((type != 'T' && type != 't') || address >= TEXT_END)
+            continue;
+        sym->address = address;
+        profile->count++;
+    }
+    fclose(f);
+    qsort(profile->symbols, profile->count, sizeof(symbol_t), by_address);
+    return 0;
+}
+
+/**
+ * Find the function holding an address.
+ * @return the last symbol at or below @p pc, NULL if none
+ */
+static symbol_t *lookup(profile_t *profile, uint32_t pc)
+{
+    int lo = 0;
+    int hi = profile->count - 1;
+    symbol_t *found = NULL;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (profile->symbols[mid].address <= pc) {
+            found = &profile->symbols[mid];
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/**
+ * Charge an instruction to its function (see #sim_step_t).
+ */
+static void step(void *param, uint32_t pc, uint32_t cycles, int sleeping)
+{
+    profile_t *profile = param;
+    symbol_t *sym;
+
+    if (sleeping) {
+        profile->asleep += cycles;
+        return;
+    }
+    sym = lookup(profile, pc);
+    if (!sym) {
+        profile->unknown += cycles;
+        return;
+    }
+    if (sym->address == pc)
+        sym->calls++;
+    sym->cycles += cycles;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total ? 100.0 * part / total : 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: simprofile -m mcu -f hz [-b baud] -s hexloader.sym hexloader.elf file.hex\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static profile_t profile;
+    sim_target_t target = { 0 };
+    sim_result_t result;
+    char const *sym_path = NULL;
+    uint32_t baud = 115200;
+    uint64_t busy, isr = 0;
+    size_t len;
+    char *hex;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "m:f:b:s:")) != -1) {
+        switch (opt) {
+            case 'm': target.mcu = optarg; break;
+            case 'f': target.f_cpu = strtoul(optarg, NULL, 10); break;
+            case 'b': baud = strtoul(optarg, NULL, 10); break;
+            case 's': sym_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (!target.mcu || !target.f_cpu || !baud || !sym_path || argc - optind != 2)
+        usage();
+    target.elf = argv[optind];
+    target.step = step;
+    target.param = &profile;
+
+    if (load_symbols(sym_path, &profile)) {
+        perror(sym_path);
+        return 1;
+    }
+    if (!(hex = sim_read_file(argv[optind + 1], &len))) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    if (sim_upload(&target, hex, len, baud, &result) != SIM_OK) {
+        fprintf(stderr, "upload failed at %u baud: %s\n", result.baud,
+                result.message[0] ? result.message : "no error message");
+        return 1;
+    }
+
+    busy = profile.unknown;
+    for (i = 0; i < profile.count; i++) {
+        busy += profile.symbols[i].cycles;
+        if (!strncmp(profile.symbols[i].name, "__vector_", 9))
+            isr += profile.symbols[i].cycles;
+    }
+    qsort(profile.symbols, profile.count, sizeof(symbol_t), by_cycles);
+
+    printf("Flat profile of %s at %u baud (flash %.1f ms, verify %.1f ms)\n\n",
+            argv[optind + 1], result.baud, result.flash_ms, result.verify_ms);
+    printf("%7s %12s %10s  %s\n", "% busy", "cycles", "calls", "function");
+    for (i = 0; i < profile.count && profile.symbols[i].cycles; i++) {
+        symbol_t *sym = &profile.symbols[i];
+        printf("%7.2f %12llu %10u  %s\n", percent(sym->cycles, busy),
+                (unsigned long long) sym->cycles, sym->calls, sym->name);
+    }
+    if (profile.unknown) {
+        printf("%7.2f %12llu %10s  %s\n", percent(profile.unknown, busy),
+                (unsigned long long) profile.unknown, "", "(unknown)");
+    }
+
+    printf("\nbusy   %12llu cycles\n", (unsigned long long) busy);
+    printf("asleep %12llu cycles, %.1f%% of the time\n", (unsigned long long) profile.asleep,
+            percent(profile.asleep, busy + profile.asleep));
+    printf("ISRs   %12llu cycles, %.1f%% of busy, %.1f%% of the time\n", (unsigned long long) isr,
+            percent(isr, busy), percent(isr, busy + profile.asleep));
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * Convert a hexloader event trace into a Chrome trace.
+ *
+ * Reads the output of the bootloader 't' command from stdin and writes
+ * a JSON timeline to stdout, which can be loaded in chrome://tracing or
+ * https://ui.perfetto.dev. Lines which are not trace events (command
+ * echo, prompt) are ignored, so a raw terminal capture will do:
+ *
+ *     trace2chrome < capture.txt > trace.json
+ *
+ * Every trace line is "<ticks> <event> <rx level>", with ticks in hex
+ * (4 us each, 24 bits). Page erases and writes become duration slices,
+ * hex lines, boots and tx stalls become instant events, and the rx
+ * buffer level of every event feeds a counter track.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#define US_PER_TICK     4               ///< bootloader timer 1 resolution
+#define TICKS_WRAP      (1UL << 24)     ///< trace timestamps are 24 bits
+
+/**
+ * Print a JSON trace event.
+ * @param first true for the first event (no leading comma)
+ * @param name event name
+ * @param ph chrome trace phase: B, E, i or C
+ * @param ts timestamp in microseconds
+ * @param level rx buffer level, for counter events
+ */
+static void print_event(int first, const char *name, char ph, uint64_t ts, int level)
+{
+    printf("%s\n  {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %llu, \"pid\": 1, \"tid\": 1",
+            first ? "" : ",", name, ph, (unsigned long long) ts);
+    if (ph == 'i')
+        printf(", \"s\": \"t\"");
+    if (ph == 'C')
+        printf(", \"args\": {\"level\": %d}", level);
+    printf("}");
+}
+
+int main(void)
+{
+    char buf[128];
+    uint64_t offset = 0;        // start of the current session, in ticks
+    uint64_t last = 0;          // last absolute timestamp, in ticks
+    unsigned long prev = 0;     // last raw timestamp
+    int first = 1;
+    int events = 0;
+
+    printf("{\"traceEvents\": [");
+    while (fgets(buf, sizeof(buf), stdin)) {
+        unsigned long ticks;
+        char type;
+        int level;
+        uint64_t ts;
+        const char *name = NULL;
+        char ph = 'i';
+
+        if (sscanf(buf, "%6lx %c %d", &ticks, &type, &level) != 3)
+            continue;
+
+        if (type == 'B') {
+            // a new bootloader session starts its clock over
+            offset = events ? last + 1 : 0;
+        }
+        else if (ticks < prev) {
+            offset += TICKS_WRAP;
+        }
+        prev = ticks;
+        last = offset + ticks;
+        ts = last * US_PER_TICK;
+
+        switch (type) {
+            case 'B': name = "boot"; break;
+            case 'L': name = "line"; break;
+            case 'e': name = "erase"; ph = 'B'; break;
+            case 'E': name = "erase"; ph = 'E'; break;
+            case 'w': name = "write"; ph = 'B'; break;
+            case 'W': name = "write"; ph = 'E'; break;
+            case 'T': name = "tx blocked"; break;
+            case 'F': break;    // rx level sample, counter only
+            default:
+                fprintf(stderr, "unknown event '%c', skipped\n", type);
+                continue;
+        }
+        if (name) {
+            print_event(first, name, ph, ts, level);
+            first = 0;
+        }
+        print_event(first, "rx buffer", 'C', ts, level);
+        first = 0;
+        events++;
+    }
+    printf("\n]}\n");
+
+    fprintf(stderr, "%d events\n", events);
+    return 0;
+}